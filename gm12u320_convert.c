@@ -0,0 +1,336 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include <asm/unaligned.h>
+
+#include "gm12u320_convert.h"
+
+static const char data_block_header[DATA_BLOCK_HEADER_SIZE] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xfb, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x04, 0x15, 0x00, 0x00, 0xfc, 0x00, 0x00,
+	0x01, 0x00, 0x00, 0xdb
+};
+
+static const char data_last_block_header[DATA_BLOCK_HEADER_SIZE] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xfb, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x2a, 0x00, 0x20, 0x00, 0xc0, 0x0f, 0x00, 0x00,
+	0x01, 0x00, 0x00, 0xd7
+};
+
+static const char data_block_footer[DATA_BLOCK_FOOTER_SIZE] = {
+	0xfb, 0x14, 0x02, 0x20, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x80, 0x00, 0x00, 0x4f
+};
+
+int gm12u320_block_size(int block)
+{
+	return (block == GM12U320_BLOCK_COUNT - 1) ? DATA_LAST_BLOCK_SIZE :
+						     DATA_BLOCK_SIZE;
+}
+
+/* Fill in the fixed header and footer around the content of a data block */
+void gm12u320_block_init(u8 *buf, int block)
+{
+	int size = gm12u320_block_size(block);
+
+	memcpy(buf, (block == GM12U320_BLOCK_COUNT - 1) ?
+		    data_last_block_header : data_block_header,
+	       DATA_BLOCK_HEADER_SIZE);
+	memcpy(buf + size - DATA_BLOCK_FOOTER_SIZE, data_block_footer,
+	       DATA_BLOCK_FOOTER_SIZE);
+}
+
+/* Pre-fill the data command of a block, only the frame bit changes */
+void gm12u320_data_cmd_init(u8 *cmd, int block)
+{
+	int size = gm12u320_block_size(block);
+
+	cmd[8] = size & 0xff;
+	cmd[9] = size >> 8;
+	cmd[20] = 0xfc - block * 4;
+	cmd[21] = block;
+}
+
+static void gm12u320_run_iter_line(struct gm12u320_run_iter *iter)
+{
+	const int x_offset = (GM12U320_REAL_WIDTH - GM12U320_USER_WIDTH) / 2;
+
+	iter->x = iter->rect.x1;
+	iter->dst = (iter->y * GM12U320_REAL_WIDTH + iter->x + x_offset) * 3;
+	iter->dst_end = min(iter->end,
+			    iter->dst + drm_rect_width(&iter->rect) * 3);
+
+	if (iter->dst < iter->start) {
+		iter->x += (iter->start - iter->dst) / 3;
+		iter->dst = iter->start;
+	}
+}
+
+/*
+ * Iterate over the pieces of the lines of rect which land in data blocks
+ * first_block up to and including last_block. A line may straddle 2 blocks,
+ * since DATA_BLOCK_CONTENT_SIZE is a multiple of 3 a pixel never does.
+ */
+void gm12u320_run_iter_init(struct gm12u320_run_iter *iter,
+			    const struct drm_rect *rect,
+			    int first_block, int last_block)
+{
+	const int line_size = GM12U320_REAL_WIDTH * 3;
+
+	iter->rect = *rect;
+	iter->start = first_block * DATA_BLOCK_CONTENT_SIZE;
+	iter->end = (last_block + 1) * DATA_BLOCK_CONTENT_SIZE;
+	iter->y = max(rect->y1, iter->start / line_size);
+	iter->y2 = min(rect->y2, DIV_ROUND_UP(iter->end, line_size));
+	iter->dst = 0;
+	iter->dst_end = 0;
+
+	if (iter->y < iter->y2)
+		gm12u320_run_iter_line(iter);
+}
+
+bool gm12u320_run_iter_next(struct gm12u320_run_iter *iter,
+			    struct gm12u320_run *run)
+{
+	int len;
+
+	while (iter->dst >= iter->dst_end) {
+		if (++iter->y >= iter->y2)
+			return false;
+		gm12u320_run_iter_line(iter);
+	}
+
+	run->block = iter->dst / DATA_BLOCK_CONTENT_SIZE;
+	run->offset = iter->dst % DATA_BLOCK_CONTENT_SIZE;
+	run->x = iter->x;
+	run->y = iter->y;
+
+	len = min(iter->dst_end, (run->block + 1) * DATA_BLOCK_CONTENT_SIZE) -
+	      iter->dst;
+	run->len = len / 3;
+	iter->x += len / 3;
+	iter->dst += len;
+
+	return true;
+}
+
+/* Returns a mask of the data blocks touched by rect */
+u32 gm12u320_rect_blocks(const struct drm_rect *rect)
+{
+	const int x_offset = (GM12U320_REAL_WIDTH - GM12U320_USER_WIDTH) / 2;
+	int first, last;
+
+	first = (rect->y1 * GM12U320_REAL_WIDTH + rect->x1 + x_offset) *
+		3 / DATA_BLOCK_CONTENT_SIZE;
+	last = ((rect->y2 - 1) * GM12U320_REAL_WIDTH + rect->x2 +
+		x_offset) * 3 - 1;
+	last /= DATA_BLOCK_CONTENT_SIZE;
+
+	return GENMASK(last, first);
+}
+
+void gm12u320_32bpp_to_24bpp_packed(u8 *dst, const u8 *src, int len)
+{
+	while (len--) {
+		*dst++ = *src++;
+		*dst++ = *src++;
+		*dst++ = *src++;
+		src++;
+	}
+}
+
+/* RGB888 has the same byte order as the device */
+void gm12u320_24bpp_copy(u8 *dst, const u8 *src, int len)
+{
+	memcpy(dst, src, len * 3);
+}
+
+void gm12u320_xbgr8888_to_24bpp(u8 *dst, const u8 *src, int len)
+{
+	while (len--) {
+		*dst++ = src[2];
+		*dst++ = src[1];
+		*dst++ = src[0];
+		src += 4;
+	}
+}
+
+/* Replicate the high bits into the low bits, so that white stays white */
+void gm12u320_rgb565_to_24bpp(u8 *dst, const u8 *src, int len)
+{
+	u16 pixel;
+	u8 r, g, b;
+
+	while (len--) {
+		pixel = get_unaligned_le16(src);
+		r = pixel >> 11;
+		g = (pixel >> 5) & 0x3f;
+		b = pixel & 0x1f;
+		*dst++ = (b << 3) | (b >> 2);
+		*dst++ = (g << 2) | (g >> 4);
+		*dst++ = (r << 3) | (r >> 2);
+		src += 2;
+	}
+}
+
+/*
+ * Reflected variants of the above, these walk the source backwards starting
+ * at the pixel src points to.
+ */
+void gm12u320_32bpp_to_24bpp_reversed(u8 *dst, const u8 *src, int len)
+{
+	while (len--) {
+		*dst++ = src[0];
+		*dst++ = src[1];
+		*dst++ = src[2];
+		src -= 4;
+	}
+}
+
+void gm12u320_24bpp_reversed(u8 *dst, const u8 *src, int len)
+{
+	while (len--) {
+		*dst++ = src[0];
+		*dst++ = src[1];
+		*dst++ = src[2];
+		src -= 3;
+	}
+}
+
+void gm12u320_xbgr8888_to_24bpp_reversed(u8 *dst, const u8 *src, int len)
+{
+	while (len--) {
+		*dst++ = src[2];
+		*dst++ = src[1];
+		*dst++ = src[0];
+		src -= 4;
+	}
+}
+
+void gm12u320_rgb565_to_24bpp_reversed(u8 *dst, const u8 *src, int len)
+{
+	while (len--) {
+		gm12u320_rgb565_to_24bpp(dst, src, 1);
+		dst += 3;
+		src -= 2;
+	}
+}
+
+/* Store a color corrected pixel in the B, G, R byte order of the device */
+static inline void gm12u320_color_pixel(const struct gm12u320_color *color,
+					u8 *dst, int b, int g, int r)
+{
+	int i, v;
+
+	if (!color->ctm) {
+		dst[0] = color->gamma[0][b];
+		dst[1] = color->gamma[1][g];
+		dst[2] = color->gamma[2][r];
+		return;
+	}
+
+	for (i = 0; i < 3; i++) {
+		v = color->ctm_lut[i][0][b] + color->ctm_lut[i][1][g] +
+		    color->ctm_lut[i][2][r];
+		dst[i] = color->gamma[i][clamp_val((v + 128) >> 8, 0, 255)];
+	}
+}
+
+/*
+ * Convert len pixels starting at pixel x of a line of a 4:2:x YCbCr fb, y
+ * and u / v point to the start of the luma resp. chroma line and the steps
+ * are the distance between samples. This covers both NV12 and YUYV. If
+ * color is not NULL the pixels get color corrected on the way.
+ */
+void gm12u320_yuv_to_24bpp(u8 *dst, const u8 *y, int y_step,
+			   const u8 *u, const u8 *v, int c_step,
+			   int x, int len,
+			   const struct gm12u320_yuv_coeffs *c,
+			   const struct gm12u320_color *color)
+{
+	s32 luma, cb, cr;
+	int b, g, r;
+
+	for (; len--; x++, dst += 3) {
+		luma = (y[x * y_step] - c->y_offset) * c->y + 0x8000;
+		cb = u[(x >> 1) * c_step] - 128;
+		cr = v[(x >> 1) * c_step] - 128;
+		b = clamp_val((luma + c->bu * cb) >> 16, 0, 255);
+		g = clamp_val((luma - c->gu * cb - c->gv * cr) >> 16, 0, 255);
+		r = clamp_val((luma + c->rv * cr) >> 16, 0, 255);
+		if (color) {
+			gm12u320_color_pixel(color, dst, b, g, r);
+		} else {
+			dst[0] = b;
+			dst[1] = g;
+			dst[2] = r;
+		}
+	}
+}
+
+/*
+ * Converters which apply the color correction while converting, so that
+ * the pixels only get touched once. step is the distance between source
+ * pixels, negative for reflected lines. bgr is for sources with B, G, R in
+ * their first 3 bytes (XRGB8888, ARGB8888 and RGB888), rgb for R, G, B
+ * (XBGR8888).
+ */
+void gm12u320_bgr_to_24bpp_color(u8 *dst, const u8 *src, int len, int step,
+				 const struct gm12u320_color *color)
+{
+	for (; len--; src += step, dst += 3)
+		gm12u320_color_pixel(color, dst, src[0], src[1], src[2]);
+}
+
+void gm12u320_rgb_to_24bpp_color(u8 *dst, const u8 *src, int len, int step,
+				 const struct gm12u320_color *color)
+{
+	for (; len--; src += step, dst += 3)
+		gm12u320_color_pixel(color, dst, src[2], src[1], src[0]);
+}
+
+void gm12u320_rgb565_to_24bpp_color(u8 *dst, const u8 *src, int len,
+				    int step,
+				    const struct gm12u320_color *color)
+{
+	u16 pixel;
+	u8 r, g, b;
+
+	for (; len--; src += step, dst += 3) {
+		pixel = get_unaligned_le16(src);
+		r = pixel >> 11;
+		g = (pixel >> 5) & 0x3f;
+		b = pixel & 0x1f;
+		gm12u320_color_pixel(color, dst, (b << 3) | (b >> 2),
+				     (g << 2) | (g >> 4), (r << 3) | (r >> 2));
+	}
+}
+
+/* Apply the color correction to len already converted pixels */
+void gm12u320_color_apply(const struct gm12u320_color *color,
+			  u8 *buf, int len)
+{
+	gm12u320_bgr_to_24bpp_color(buf, buf, len, 3, color);
+}
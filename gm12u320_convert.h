@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ */
+
+#ifndef _GM12U320_CONVERT_H_
+#define _GM12U320_CONVERT_H_
+
+/*
+ * The data block layout and pixel conversion code. This only uses plain
+ * types and helpers, so that it can also be built and exercised outside of
+ * the kernel, without a device, against the shim for these few headers in
+ * tools/shim.
+ */
+#include <linux/kref.h>
+#include <linux/types.h>
+
+#include <drm/drm_rect.h>
+
+/*
+ * The DLP has an actual width of 854 pixels, but that is not a multiple
+ * of 8, breaking things left and right, so we export a width of 848.
+ */
+#define GM12U320_USER_WIDTH		848
+#define GM12U320_REAL_WIDTH		854
+#define GM12U320_HEIGHT			480
+
+#define GM12U320_BLOCK_COUNT		20
+#define GM12U320_ALL_BLOCKS		GENMASK(GM12U320_BLOCK_COUNT - 1, 0)
+
+#define DATA_BLOCK_HEADER_SIZE		84
+#define DATA_BLOCK_CONTENT_SIZE		64512
+#define DATA_BLOCK_FOOTER_SIZE		20
+#define DATA_BLOCK_SIZE			(DATA_BLOCK_HEADER_SIZE + \
+					 DATA_BLOCK_CONTENT_SIZE + \
+					 DATA_BLOCK_FOOTER_SIZE)
+#define DATA_LAST_BLOCK_CONTENT_SIZE	4032
+#define DATA_LAST_BLOCK_SIZE		(DATA_BLOCK_HEADER_SIZE + \
+					 DATA_LAST_BLOCK_CONTENT_SIZE + \
+					 DATA_BLOCK_FOOTER_SIZE)
+
+/* YCbCr to RGB matrix in 16.16 fixed point */
+struct gm12u320_yuv_coeffs {
+	int                              y_offset;
+	s32                              y;
+	s32                              rv;
+	s32                              gu;
+	s32                              gv;
+	s32                              bu;
+};
+
+/*
+ * The CRTC color correction baked into lookup tables, indexed by the byte
+ * order of the device (B, G, R). The CTM tables hold the products of a
+ * matrix coefficient and a channel value in 24.8 fixed point.
+ */
+struct gm12u320_color {
+	struct kref                      ref;
+	bool                             ctm;
+	s32                              ctm_lut[3][3][256];
+	u8                               gamma[3][256];
+};
+
+/*
+ * A piece of a line of a rect which lies within a single data block, len
+ * pixels starting at screen coordinates x, y land at byte offset of the
+ * content of the block.
+ */
+struct gm12u320_run {
+	int                              block;
+	int                              offset;
+	int                              x;
+	int                              y;
+	int                              len;
+};
+
+struct gm12u320_run_iter {
+	struct drm_rect                  rect;
+	int                              start;
+	int                              end;
+	int                              x;
+	int                              y;
+	int                              y2;
+	int                              dst;
+	int                              dst_end;
+};
+
+int gm12u320_block_size(int block);
+void gm12u320_block_init(u8 *buf, int block);
+void gm12u320_data_cmd_init(u8 *cmd, int block);
+
+void gm12u320_run_iter_init(struct gm12u320_run_iter *iter,
+			    const struct drm_rect *rect,
+			    int first_block, int last_block);
+bool gm12u320_run_iter_next(struct gm12u320_run_iter *iter,
+			    struct gm12u320_run *run);
+u32 gm12u320_rect_blocks(const struct drm_rect *rect);
+
+void gm12u320_32bpp_to_24bpp_packed(u8 *dst, const u8 *src, int len);
+void gm12u320_24bpp_copy(u8 *dst, const u8 *src, int len);
+void gm12u320_xbgr8888_to_24bpp(u8 *dst, const u8 *src, int len);
+void gm12u320_rgb565_to_24bpp(u8 *dst, const u8 *src, int len);
+void gm12u320_32bpp_to_24bpp_reversed(u8 *dst, const u8 *src, int len);
+void gm12u320_24bpp_reversed(u8 *dst, const u8 *src, int len);
+void gm12u320_xbgr8888_to_24bpp_reversed(u8 *dst, const u8 *src, int len);
+void gm12u320_rgb565_to_24bpp_reversed(u8 *dst, const u8 *src, int len);
+void gm12u320_yuv_to_24bpp(u8 *dst, const u8 *y, int y_step,
+			   const u8 *u, const u8 *v, int c_step,
+			   int x, int len,
+			   const struct gm12u320_yuv_coeffs *c,
+			   const struct gm12u320_color *color);
+void gm12u320_bgr_to_24bpp_color(u8 *dst, const u8 *src, int len, int step,
+				 const struct gm12u320_color *color);
+void gm12u320_rgb_to_24bpp_color(u8 *dst, const u8 *src, int len, int step,
+				 const struct gm12u320_color *color);
+void gm12u320_rgb565_to_24bpp_color(u8 *dst, const u8 *src, int len,
+				    int step,
+				    const struct gm12u320_color *color);
+void gm12u320_color_apply(const struct gm12u320_color *color,
+			  u8 *buf, int len);
+
+#endif /* _GM12U320_CONVERT_H_ */
@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ */
+
+#include <linux/kernel.h>
+
+#include "gm12u320_convert.h"
+#include "gm12u320_damage.h"
+
+int gm12u320_rect_area(const struct drm_rect *rect)
+{
+	return drm_rect_width(rect) * drm_rect_height(rect);
+}
+
+static void gm12u320_rect_union(struct drm_rect *rect,
+				const struct drm_rect *other)
+{
+	rect->x1 = min(rect->x1, other->x1);
+	rect->y1 = min(rect->y1, other->y1);
+	rect->x2 = max(rect->x2, other->x2);
+	rect->y2 = max(rect->y2, other->y2);
+}
+
+bool gm12u320_rect_contains(const struct drm_rect *rect,
+			    const struct drm_rect *other)
+{
+	return rect->x1 <= other->x1 && rect->y1 <= other->y1 &&
+	       rect->x2 >= other->x2 && rect->y2 >= other->y2;
+}
+
+void gm12u320_damage_add(struct gm12u320_damage *damage,
+			 const struct drm_rect *rect)
+{
+	struct drm_rect merged;
+	int i, growth, best = 0, best_growth = INT_MAX;
+
+	if (!drm_rect_visible(rect))
+		return;
+
+	for (i = 0; i < damage->count; i++) {
+		if (gm12u320_rect_contains(&damage->rects[i], rect))
+			return;
+	}
+
+	/* Drop rects covered by the new one */
+	for (i = 0; i < damage->count; ) {
+		if (gm12u320_rect_contains(rect, &damage->rects[i]))
+			damage->rects[i] = damage->rects[--damage->count];
+		else
+			i++;
+	}
+
+	if (damage->count < GM12U320_MAX_DAMAGE_RECTS) {
+		damage->rects[damage->count++] = *rect;
+		return;
+	}
+
+	/* Full, merge with the rect which grows the least by doing so */
+	for (i = 0; i < damage->count; i++) {
+		merged = damage->rects[i];
+		gm12u320_rect_union(&merged, rect);
+		growth = gm12u320_rect_area(&merged) -
+			 gm12u320_rect_area(&damage->rects[i]);
+		if (growth < best_growth) {
+			best_growth = growth;
+			best = i;
+		}
+	}
+	gm12u320_rect_union(&damage->rects[best], rect);
+}
+
+void gm12u320_damage_merge(struct gm12u320_damage *damage,
+			   const struct gm12u320_damage *other)
+{
+	int i;
+
+	for (i = 0; i < other->count; i++)
+		gm12u320_damage_add(damage, &other->rects[i]);
+}
+
+/* Returns a mask of the data blocks touched by damage */
+u32 gm12u320_damage_blocks(const struct gm12u320_damage *damage)
+{
+	u32 blocks = 0;
+	int i;
+
+	for (i = 0; i < damage->count; i++)
+		blocks |= gm12u320_rect_blocks(&damage->rects[i]);
+
+	return blocks;
+}
+
+bool gm12u320_damage_contains(const struct gm12u320_damage *damage,
+			      int x, int y)
+{
+	int i;
+
+	for (i = 0; i < damage->count; i++) {
+		if (x >= damage->rects[i].x1 && x < damage->rects[i].x2 &&
+		    y >= damage->rects[i].y1 && y < damage->rects[i].y2)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Queue damage of fb, with an optional flip event. A different fb replaces
+ * the pending one together with its damage, then this returns true and the
+ * caller must take a reference on fb and drop the one on *old_fb. An event
+ * which will not get sent by the worker, the one it replaces or event itself
+ * if the worker is dead, is returned in *old_event for the caller to send.
+ * Called with fb_update.lock held.
+ */
+bool gm12u320_pending_mark(struct gm12u320_pending *pending,
+			   struct drm_framebuffer *fb,
+			   const struct gm12u320_damage *damage,
+			   struct drm_pending_vblank_event *event,
+			   struct drm_framebuffer **old_fb,
+			   struct drm_pending_vblank_event **old_event)
+{
+	bool replaced = pending->fb != fb;
+
+	*old_fb = NULL;
+	*old_event = NULL;
+
+	if (replaced) {
+		*old_fb = pending->fb;
+		pending->fb = fb;
+		pending->damage = *damage;
+	} else {
+		gm12u320_damage_merge(&pending->damage, damage);
+	}
+
+	if (event && pending->dead) {
+		/* The worker is gone, the frame will not get drawn */
+		*old_event = event;
+	} else if (event) {
+		/* The frame of the old event got coalesced into the new one */
+		*old_event = pending->event;
+		pending->event = event;
+	}
+
+	return replaced;
+}
+
+/*
+ * Take the pending fb, its damage and its flip event, the caller owns the
+ * returned fb reference and the event. Called with fb_update.lock held.
+ */
+struct drm_framebuffer *
+gm12u320_pending_take(struct gm12u320_pending *pending,
+		      struct gm12u320_damage *damage,
+		      struct drm_pending_vblank_event **event)
+{
+	struct drm_framebuffer *fb = pending->fb;
+
+	*damage = pending->damage;
+	*event = pending->event;
+	pending->fb = NULL;
+	pending->event = NULL;
+
+	return fb;
+}
+
+/*
+ * Mark the worker dead, returns the pending event for the caller to send.
+ * Called with fb_update.lock held.
+ */
+struct drm_pending_vblank_event *
+gm12u320_pending_kill(struct gm12u320_pending *pending)
+{
+	struct drm_pending_vblank_event *event = pending->event;
+
+	pending->dead = true;
+	pending->event = NULL;
+
+	return event;
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ */
+
+#ifndef _GM12U320_DAMAGE_H_
+#define _GM12U320_DAMAGE_H_
+
+/*
+ * Damage tracking and the bookkeeping of the frame pending for the update
+ * worker. Like gm12u320_convert.[ch] this only uses plain types, the fb and
+ * the flip event are opaque here, so that it also builds in tools/.
+ */
+#include <linux/types.h>
+
+#include <drm/drm_rect.h>
+
+struct drm_framebuffer;
+struct drm_pending_vblank_event;
+
+#define GM12U320_MAX_DAMAGE_RECTS	8
+
+/*
+ * A bounded list of damaged rects, rects only get merged when the list
+ * overflows.
+ */
+struct gm12u320_damage {
+	struct drm_rect                  rects[GM12U320_MAX_DAMAGE_RECTS];
+	int                              count;
+};
+
+/*
+ * The frame the update worker draws next. Updates of the same fb coalesce
+ * into it, of their flip events only the last one stays pending.
+ */
+struct gm12u320_pending {
+	struct drm_framebuffer          *fb;
+	struct gm12u320_damage           damage;
+	/* Flip event to send once fb has been drawn */
+	struct drm_pending_vblank_event *event;
+	/* The worker exited on an error, events get handed back right away */
+	bool                             dead;
+};
+
+int gm12u320_rect_area(const struct drm_rect *rect);
+bool gm12u320_rect_contains(const struct drm_rect *rect,
+			    const struct drm_rect *other);
+
+void gm12u320_damage_add(struct gm12u320_damage *damage,
+			 const struct drm_rect *rect);
+void gm12u320_damage_merge(struct gm12u320_damage *damage,
+			   const struct gm12u320_damage *other);
+u32 gm12u320_damage_blocks(const struct gm12u320_damage *damage);
+bool gm12u320_damage_contains(const struct gm12u320_damage *damage,
+			      int x, int y);
+
+bool gm12u320_pending_mark(struct gm12u320_pending *pending,
+			   struct drm_framebuffer *fb,
+			   const struct gm12u320_damage *damage,
+			   struct drm_pending_vblank_event *event,
+			   struct drm_framebuffer **old_fb,
+			   struct drm_pending_vblank_event **old_event);
+struct drm_framebuffer *
+gm12u320_pending_take(struct gm12u320_pending *pending,
+		      struct gm12u320_damage *damage,
+		      struct drm_pending_vblank_event **event);
+struct drm_pending_vblank_event *
+gm12u320_pending_kill(struct gm12u320_pending *pending);
+
+#endif /* _GM12U320_DAMAGE_H_ */
@@ -0,0 +1,3376 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ */
+
+#include <linux/bitmap.h>
+#include <linux/dma-buf.h>
+#include <linux/highmem.h>
+#include <linux/module.h>
+#include <linux/reservation.h>
+#include <linux/scatterlist.h>
+#include <linux/seq_file.h>
+#include <linux/usb.h>
+#include <linux/vmalloc.h>
+#include <linux/xxhash.h>
+
+#include <asm/unaligned.h>
+
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#include <asm/fpu/xstate.h>
+#endif
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+#include <asm/cpufeature.h>
+#include <asm/neon.h>
+#endif
+
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_atomic_state_helper.h>
+#include <drm/drm_blend.h>
+#include <drm/drm_connector.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_debugfs.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fb_helper.h>
+#include <drm/drm_file.h>
+#include <drm/drm_format_helper.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_gem_shmem_helper.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_ioctl.h>
+#include <drm/drm_modeset_helper.h>
+#include <drm/drm_modeset_helper_vtables.h>
+#include <drm/drm_plane_helper.h>
+#include <drm/drm_probe_helper.h>
+#include <drm/drm_simple_kms_helper.h>
+#include <drm/drm_vblank.h>
+
+#include "gm12u320_convert.h"
+#include "gm12u320_damage.h"
+
+#define CREATE_TRACE_POINTS
+#include "gm12u320_trace.h"
+
+static bool eco_mode;
+module_param(eco_mode, bool, 0644);
+MODULE_PARM_DESC(eco_mode, "Turn on Eco mode (less bright, more silent)");
+
+static unsigned int xfer_depth = 4;
+module_param(xfer_depth, uint, 0644);
+MODULE_PARM_DESC(xfer_depth, "Number of data blocks in flight (1 = fully serialized, default 4)");
+
+static bool low_latency;
+module_param(low_latency, bool, 0644);
+MODULE_PARM_DESC(low_latency, "Send each data block as soon as it is converted");
+
+static bool partial_frames;
+module_param(partial_frames, bool, 0644);
+MODULE_PARM_DESC(partial_frames, "Only send the changed data blocks of a frame (experimental)");
+
+static bool damage_hash;
+module_param(damage_hash, bool, 0644);
+MODULE_PARM_DESC(damage_hash, "Only convert the damaged rows whose content actually changed, for clients which always damage the entire frame");
+
+
+#define KEEPALIVE_FULL_FRAME		0
+#define KEEPALIVE_DRAW_ONLY		1
+#define KEEPALIVE_SINGLE_BLOCK		2
+
+static int keepalive = KEEPALIVE_FULL_FRAME;
+
+static int gm12u320_keepalive_set(const char *val,
+				  const struct kernel_param *kp)
+{
+	int ret, mode;
+
+	ret = kstrtoint(val, 0, &mode);
+	if (ret)
+		return ret;
+
+	if (mode < KEEPALIVE_FULL_FRAME || mode > KEEPALIVE_SINGLE_BLOCK)
+		return -EINVAL;
+
+	return param_set_int(val, kp);
+}
+
+static const struct kernel_param_ops gm12u320_keepalive_ops = {
+	.set = gm12u320_keepalive_set,
+	.get = param_get_int,
+};
+
+module_param_cb(keepalive, &gm12u320_keepalive_ops, &keepalive, 0644);
+MODULE_PARM_DESC(keepalive, "Idle keepalive: 0 = full frame (default), 1 = draw command only, 2 = single block + draw command");
+
+#define DRIVER_NAME		"gm12u320"
+#define DRIVER_DESC		"Grain Media GM12U320 USB projector display"
+#define DRIVER_DATE		"2019"
+#define DRIVER_MAJOR		1
+#define DRIVER_MINOR		0
+#define DRIVER_PATCHLEVEL	1
+
+#define GM12U320_CURSOR_SIZE		64
+#define GM12U320_GAMMA_SIZE		256
+
+/* Bytes of padding on each side of a line */
+#define GM12U320_PAD_SIZE		((GM12U320_REAL_WIDTH - \
+					  GM12U320_USER_WIDTH) / 2 * 3)
+/* The right padding of a line plus the left padding of the next */
+#define GM12U320_SG_ZERO_SIZE		(2 * GM12U320_PAD_SIZE)
+
+/*
+ * Large damage gets converted by up to this many CPUs, split by data block,
+ * smaller damage is not worth the dispatch overhead.
+ */
+#define GM12U320_CONVERT_JOBS		4
+#define GM12U320_PARALLEL_MIN_PIXELS	(GM12U320_USER_WIDTH * 96)
+
+/* log2 histogram buckets, the last bucket is for >= 2^18 us (262 ms) */
+#define GM12U320_HIST_BUCKETS		20
+
+#define MISC_RCV_EPT			1
+#define DATA_RCV_EPT			2
+#define DATA_SND_EPT			3
+#define MISC_SND_EPT			4
+
+/*
+ * Max sg entries of a zero-copy data block: header, footer (which may span
+ * 2 pages of a page backed data_buf) and per line the padding plus the (at
+ * most 2) pages the line of the fb spans.
+ */
+#define GM12U320_SG_LINES		(DIV_ROUND_UP(DATA_BLOCK_CONTENT_SIZE, \
+					 GM12U320_REAL_WIDTH * 3) + 1)
+#define GM12U320_SG_MAX			(3 + 3 * GM12U320_SG_LINES)
+
+/* The order-0 pages backing a data block */
+#define GM12U320_BUF_PAGES		DIV_ROUND_UP(DATA_BLOCK_SIZE, PAGE_SIZE)
+
+#define CMD_SIZE			31
+#define READ_STATUS_SIZE		13
+#define READ_STATUS_RESULT		12
+#define MISC_VALUE_SIZE			4
+
+#define CMD_TIMEOUT			msecs_to_jiffies(200)
+#define DATA_TIMEOUT			msecs_to_jiffies(1000)
+#define IDLE_TIMEOUT			msecs_to_jiffies(2000)
+#define FIRST_FRAME_TIMEOUT		msecs_to_jiffies(2000)
+/* Initial vblank period, until we have timed a full frame */
+#define VBLANK_MIN_PERIOD_NS		(NSEC_PER_SEC / 60)
+
+#define MISC_REQ_GET_SET_ECO_A		0xff
+#define MISC_REQ_GET_SET_ECO_B		0x35
+/* Windows driver does once every second, with arg d = 1, other args 0 */
+#define MISC_REQ_UNKNOWN1_A		0xff
+#define MISC_REQ_UNKNOWN1_B		0x38
+/* Windows driver does this on init, with arg a, b = 0, c = 0xa0, d = 4 */
+#define MISC_REQ_UNKNOWN2_A		0xa5
+#define MISC_REQ_UNKNOWN2_B		0x00
+
+/*
+ * A single data block (or the draw command) transfer: a command, optionally
+ * followed by a data block, followed by a status read.
+ */
+struct gm12u320_xfer {
+	struct gm12u320_device          *gm12u320;
+	int                              block;
+	struct urb                      *cmd;
+	/* A single sg urb, or one urb per page without host sg support */
+	struct urb                      *data[GM12U320_BUF_PAGES];
+	int                              data_urbs;
+	struct urb                      *status;
+	/* The vmapped data_buf to flush from the cpu cache before sending */
+	void                            *flush;
+	/* Submission / previous stage completion time, for tracing */
+	ktime_t                          last;
+};
+
+/*
+ * The state of the (unscaled) overlay or cursor plane, fb is NULL when the
+ * plane is not visible. vaddr is only valid during conversion.
+ */
+struct gm12u320_plane {
+	struct drm_framebuffer          *fb;
+	int                              src_x;
+	int                              src_y;
+	struct drm_rect                  dst;
+	const struct gm12u320_yuv_coeffs *coeffs;
+	const u8                        *vaddr;
+};
+
+struct gm12u320_planes {
+	struct gm12u320_plane            overlay;
+	struct gm12u320_plane            cursor;
+	/* Of the primary plane, as DRM_MODE_REFLECT_X / _Y bits only */
+	unsigned int                     rotation;
+	/* NULL when there is no color correction */
+	struct gm12u320_color           *color;
+};
+
+/*
+ * An fb keeps the vmap of its first GEM object from the first prepare_fb of
+ * a plane it gets put on until it gets destroyed. The worker holds fb
+ * references, so it reads the fb through this mapping without mapping it
+ * again for each frame, also after the fb has left its plane.
+ */
+struct gm12u320_fb {
+	struct drm_framebuffer           base;
+	void                            *vaddr;
+};
+
+#define to_gm12u320_fb(fb)	container_of(fb, struct gm12u320_fb, base)
+
+/* Per plane, the rendering which must finish before the planes get read */
+enum gm12u320_fence_slot {
+	GM12U320_FENCE_PRIMARY,
+	GM12U320_FENCE_OVERLAY,
+	GM12U320_FENCE_CURSOR,
+	GM12U320_FENCE_SLOTS
+};
+
+struct gm12u320_fence {
+	struct gm12u320_device          *gm12u320;
+	struct dma_fence                *fence;
+	struct dma_fence_cb              cb;
+};
+
+/* A range of data blocks to convert on another CPU */
+struct gm12u320_convert_job {
+	struct work_struct               work;
+	struct gm12u320_device          *gm12u320;
+	int                              set;
+	struct drm_framebuffer          *fb;
+	const u8                        *vaddr;
+	const struct gm12u320_planes    *planes;
+	const struct gm12u320_damage    *damage;
+	int                              first_block;
+	int                              last_block;
+};
+
+struct gm12u320_device {
+	struct drm_device	         dev;
+	struct drm_simple_display_pipe   pipe;
+	struct drm_plane                 overlay;
+	struct drm_plane                 cursor;
+	struct drm_connector	         conn;
+	struct usb_device               *udev;
+	/* Endpoint numbers, see gm12u320_find_endpoints() */
+	struct {
+		u8                       misc_rcv;
+		u8                       data_rcv;
+		u8                       data_snd;
+		u8                       misc_snd;
+	} ep;
+	unsigned char                   *cmd_buf;
+	/* 2 sets of blocks, so that we can fill one while sending the other */
+	unsigned char                   *data_buf[2][GM12U320_BLOCK_COUNT];
+	bool                             pipe_enabled;
+	bool                             partial_rejected;
+	bool                             keepalive_rejected;
+	struct {
+		struct usb_anchor        anchor;
+		spinlock_t               lock;
+		struct completion        done;
+		/* One xfer per data block, the last one is the draw command */
+		struct gm12u320_xfer     xfer[GM12U320_BLOCK_COUNT + 1];
+		/* Indexes into xfer[] of the transfers for the current frame */
+		int                      order[GM12U320_BLOCK_COUNT + 1];
+		int                      count;
+		int                      ready;
+		int                      depth;
+		int                      submitted;
+		int                      completed;
+		int                      error;
+		bool                     status_error;
+		/* Flip event to send when the draw command is acknowledged */
+		struct drm_pending_vblank_event *event;
+		u64                      bytes;
+		ktime_t                  start;
+		ktime_t                  end;
+	} pipeline;
+	struct {
+		bool                     run;
+		struct workqueue_struct *workq;
+		struct work_struct       work;
+		wait_queue_head_t        waitq;
+		struct mutex             lock;
+		struct gm12u320_pending  pending;
+		/* Rendering to the planes, which must finish before we read them */
+		struct gm12u320_fence    fences[GM12U320_FENCE_SLOTS];
+		struct gm12u320_planes   planes;
+		/* The worker itself converts the first range of blocks */
+		struct gm12u320_convert_job jobs[GM12U320_CONVERT_JOBS - 1];
+	} fb_update;
+	struct {
+		struct hrtimer           timer;
+		bool                     enabled;
+		/* Average time to send a full frame */
+		u32                      period_ns;
+		/* Time of the last vblank */
+		ktime_t                  last;
+	} vblank;
+	struct {
+		/* Per screen row, of the fb content it was converted from */
+		u64                      rows[GM12U320_HEIGHT];
+		/* The rows whose hash is valid */
+		DECLARE_BITMAP(hashed, GM12U320_HEIGHT);
+		/* The plane state the rows were converted with, referenced */
+		struct gm12u320_planes   planes;
+	} hash;
+	struct {
+		bool                     supported;
+		/* Source of the padding around each line */
+		u8                      *zero;
+		/* Per set, the fb the data blocks point into, if any */
+		struct drm_framebuffer  *fb[2];
+		/* The set's data_buf contents are outdated */
+		bool                     stale[2];
+		struct scatterlist      *sgl[2][GM12U320_BLOCK_COUNT];
+		int                      nents[2][GM12U320_BLOCK_COUNT];
+	} sg;
+	struct {
+		/* The pages behind each (vmapped) data_buf */
+		struct page             *pages[2][GM12U320_BLOCK_COUNT]
+					      [GM12U320_BUF_PAGES];
+		/* The host can take a block as one sg urb of its pages */
+		bool                     sg;
+		struct scatterlist      *sgl[2][GM12U320_BLOCK_COUNT];
+		int                      nents[2][GM12U320_BLOCK_COUNT];
+		/* Memory used by data_buf and the time it took to allocate */
+		size_t                   footprint;
+		s64                      alloc_us;
+	} buf;
+	struct {
+		u64                      frames;
+		/* Updates merged into a not yet converted frame */
+		u64                      frames_coalesced;
+		u64                      keepalive_frames;
+		/* Keepalives which did not need a full frame */
+		u64                      full_frames_avoided;
+		/* Frames send straight from the fb pages */
+		u64                      zero_copy_frames;
+		/* Conversions split across CPUs */
+		u64                      parallel_converts;
+		/* Damaged rows hashed resp. found unchanged by damage_hash */
+		u64                      hash_rows;
+		u64                      hash_rows_unchanged;
+		u64                      hash_frames_skipped;
+		u64                      bytes;
+		u32                      convert_us[GM12U320_HIST_BUCKETS];
+		u32                      xfer_us[GM12U320_HIST_BUCKETS];
+		int                      last_error;
+		ktime_t                  last_draw;
+	} stats;
+};
+
+/*
+ * The protocol, as far as we use it. This is all that an emulation of the
+ * device needs to implement to be driven by this driver, as done by the
+ * FunctionFS gadget in tools/gm12u320_emu.c.
+ *
+ * Commands are 31 byte USB mass-storage style command blocks ("USBC"),
+ * bytes 8 - 11 hold the length of the data stage, byte 12 its direction
+ * (0x80 = to the host) and byte 15 selects the command:
+ *
+ * 0xff data:  sent on DATA_SND_EPT, followed by a data block of the length
+ *             in bytes 8 - 9 on DATA_SND_EPT. Byte 20 is 0xfc - 4 * block,
+ *             byte 21 is the block number, with the frame bit in bit 7.
+ * 0xfe draw:  sent on DATA_SND_EPT without a data stage, shows the frame
+ *             made up by the last received blocks. The device may take up
+ *             to FIRST_FRAME_TIMEOUT to answer the first draw.
+ * 0xfd misc:  sent on MISC_SND_EPT, bytes 20 - 21 are the request and
+ *             bytes 22 - 25 its arguments. The device answers with a
+ *             MISC_VALUE_SIZE value on MISC_RCV_EPT.
+ *
+ * Every command is completed by a READ_STATUS_SIZE mass-storage style
+ * status ("USBS") read from DATA_RCV_EPT resp. MISC_RCV_EPT, a non-zero
+ * byte READ_STATUS_RESULT signals failure.
+ *
+ * A data block is a DATA_BLOCK_HEADER_SIZE header, DATA_BLOCK_CONTENT_SIZE
+ * (DATA_LAST_BLOCK_CONTENT_SIZE for the last block) bytes of the frame and
+ * a DATA_BLOCK_FOOTER_SIZE footer. The frame is GM12U320_HEIGHT lines of
+ * GM12U320_REAL_WIDTH pixels in B, G, R byte order, back to back.
+ */
+static const char cmd_data[CMD_SIZE] = {
+	0x55, 0x53, 0x42, 0x43, 0x00, 0x00, 0x00, 0x00,
+	0x68, 0xfc, 0x00, 0x00, 0x00, 0x00, 0x10, 0xff,
+	0x00, 0x00, 0x00, 0x00, 0xfc, 0x00, 0x80, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static const char cmd_draw[CMD_SIZE] = {
+	0x55, 0x53, 0x42, 0x43, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0xfe,
+	0x00, 0x00, 0x00, 0xc0, 0xd1, 0x05, 0x00, 0x40,
+	0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static const char cmd_misc[CMD_SIZE] = {
+	0x55, 0x53, 0x42, 0x43, 0x00, 0x00, 0x00, 0x00,
+	0x04, 0x00, 0x00, 0x00, 0x80, 0x01, 0x10, 0xfd,
+	0x00, 0x00, 0x00, 0xc0, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static void gm12u320_xfer_out_complete(struct urb *urb);
+static void gm12u320_xfer_status_complete(struct urb *urb);
+static void gm12u320_color_put(struct gm12u320_color *color);
+
+static struct urb *gm12u320_alloc_urb(struct gm12u320_xfer *xfer,
+				      unsigned int pipe, void *buf, int len,
+				      usb_complete_t complete)
+{
+	struct urb *urb;
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		return NULL;
+
+	usb_fill_bulk_urb(urb, xfer->gm12u320->udev, pipe, buf, len, complete,
+			  xfer);
+	return urb;
+}
+
+/*
+ * The data stage of a block is sent as data_urbs urbs, all but the last one
+ * PAGE_SIZE long. The data buffers get set on submit.
+ */
+static int gm12u320_xfer_alloc(struct gm12u320_device *gm12u320,
+			       struct gm12u320_xfer *xfer, int block,
+			       const char *cmd, int data_size, int data_urbs)
+{
+	struct usb_device *udev = gm12u320->udev;
+	unsigned char *buf;
+	int i, len;
+
+	xfer->gm12u320 = gm12u320;
+	xfer->block = block;
+
+	buf = kmemdup(cmd, CMD_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	xfer->cmd = gm12u320_alloc_urb(xfer,
+				       usb_sndbulkpipe(udev, gm12u320->ep.data_snd),
+				       buf, CMD_SIZE,
+				       gm12u320_xfer_out_complete);
+	if (!xfer->cmd) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < data_urbs; i++) {
+		len = (i == data_urbs - 1) ? data_size - i * PAGE_SIZE :
+					     PAGE_SIZE;
+		xfer->data[i] = gm12u320_alloc_urb(xfer,
+					usb_sndbulkpipe(udev, gm12u320->ep.data_snd),
+					NULL, len, gm12u320_xfer_out_complete);
+		if (!xfer->data[i])
+			return -ENOMEM;
+		xfer->data_urbs++;
+	}
+
+	buf = kmalloc(READ_STATUS_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	xfer->status = gm12u320_alloc_urb(xfer,
+					  usb_rcvbulkpipe(udev, gm12u320->ep.data_rcv),
+					  buf, READ_STATUS_SIZE,
+					  gm12u320_xfer_status_complete);
+	if (!xfer->status) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void gm12u320_xfer_free(struct gm12u320_xfer *xfer)
+{
+	int i;
+
+	if (xfer->cmd)
+		kfree(xfer->cmd->transfer_buffer);
+	if (xfer->status)
+		kfree(xfer->status->transfer_buffer);
+
+	usb_free_urb(xfer->cmd);
+	for (i = 0; i < xfer->data_urbs; i++)
+		usb_free_urb(xfer->data[i]);
+	usb_free_urb(xfer->status);
+}
+
+/*
+ * Allocate a data block in order-0 pages, vmapped so that the cpu sees it
+ * as one buffer, with the fixed header and footer filled in. On failure the
+ * caller must still free pages with gm12u320_block_free().
+ */
+static u8 *gm12u320_block_alloc(struct page **pages, int block)
+{
+	int i, size = gm12u320_block_size(block);
+	int n = DIV_ROUND_UP(size, PAGE_SIZE);
+	u8 *buf;
+
+	for (i = 0; i < n; i++) {
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!pages[i])
+			return NULL;
+	}
+
+	buf = vmap(pages, n, VM_MAP, PAGE_KERNEL);
+	if (!buf)
+		return NULL;
+
+	gm12u320_block_init(buf, block);
+
+	return buf;
+}
+
+static void gm12u320_block_free(struct page **pages, u8 *buf)
+{
+	int i;
+
+	vunmap(buf);
+	for (i = 0; i < GM12U320_BUF_PAGES; i++) {
+		if (pages[i])
+			__free_page(pages[i]);
+		pages[i] = NULL;
+	}
+}
+
+/*
+ * Set up sg entries for a part of the vmapped data_buf, split at its page
+ * boundaries, returns the number of entries used.
+ */
+static int gm12u320_sg_set_data(struct scatterlist *sg, u8 *buf, int len)
+{
+	int n, chunk;
+
+	for (n = 0; len; n++, buf += chunk, len -= chunk) {
+		chunk = min_t(int, len, PAGE_SIZE - offset_in_page(buf));
+		sg_set_page(&sg[n], vmalloc_to_page(buf), chunk,
+			    offset_in_page(buf));
+	}
+
+	return n;
+}
+
+static int gm12u320_usb_alloc(struct gm12u320_device *gm12u320)
+{
+	int i, n, ret, set, block_size, data_urbs;
+	struct scatterlist *sgl;
+	ktime_t start;
+	u8 *buf;
+
+	/* The blocks hold exactly one frame and never split a pixel */
+	BUILD_BUG_ON(DATA_BLOCK_CONTENT_SIZE % 3);
+	BUILD_BUG_ON((GM12U320_BLOCK_COUNT - 1) * DATA_BLOCK_CONTENT_SIZE +
+		     DATA_LAST_BLOCK_CONTENT_SIZE !=
+		     GM12U320_REAL_WIDTH * GM12U320_HEIGHT * 3);
+	/* The data command has a 16 bit block size field */
+	BUILD_BUG_ON(DATA_BLOCK_SIZE > 0xffff);
+	/* Zero-copy always gets a host which can also send blocks as sg */
+	BUILD_BUG_ON(GM12U320_BUF_PAGES > GM12U320_SG_MAX);
+
+	gm12u320->cmd_buf = kmalloc(CMD_SIZE, GFP_KERNEL);
+	if (!gm12u320->cmd_buf)
+		return -ENOMEM;
+
+	/*
+	 * The data blocks are a bit over 63k, so kmalloc would need order-4
+	 * contiguous pages for each of them, which may fail or stall on
+	 * compaction when memory is fragmented. Use order-0 pages instead,
+	 * sent as a single sg urb, or as one urb per page when the host
+	 * controller does not support sg, like usb_sg_init() does.
+	 */
+	gm12u320->buf.sg =
+		gm12u320->udev->bus->sg_tablesize >= GM12U320_BUF_PAGES;
+	start = ktime_get();
+
+	for (i = 0; i < GM12U320_BLOCK_COUNT; i++) {
+		block_size = gm12u320_block_size(i);
+		n = DIV_ROUND_UP(block_size, PAGE_SIZE);
+
+		for (set = 0; set < 2; set++) {
+			buf = gm12u320_block_alloc(gm12u320->buf.pages[set][i],
+						   i);
+			if (!buf)
+				return -ENOMEM;
+
+			gm12u320->data_buf[set][i] = buf;
+			gm12u320->buf.footprint += n * PAGE_SIZE;
+
+			if (!gm12u320->buf.sg)
+				continue;
+
+			sgl = kmalloc_array(n, sizeof(*sgl), GFP_KERNEL);
+			if (!sgl)
+				return -ENOMEM;
+
+			/* vmap() is page aligned, so this uses all n entries */
+			sg_init_table(sgl, n);
+			gm12u320_sg_set_data(sgl, buf, block_size);
+			gm12u320->buf.sgl[set][i] = sgl;
+			gm12u320->buf.nents[set][i] = n;
+			gm12u320->buf.footprint += ksize(sgl);
+		}
+
+		data_urbs = gm12u320->buf.sg ? 1 : n;
+		ret = gm12u320_xfer_alloc(gm12u320,
+					  &gm12u320->pipeline.xfer[i], i,
+					  cmd_data, block_size, data_urbs);
+		if (ret)
+			return ret;
+
+		gm12u320_data_cmd_init(
+			gm12u320->pipeline.xfer[i].cmd->transfer_buffer, i);
+	}
+
+	gm12u320->buf.alloc_us = ktime_us_delta(ktime_get(), start);
+
+	ret = gm12u320_xfer_alloc(gm12u320,
+			&gm12u320->pipeline.xfer[GM12U320_BLOCK_COUNT],
+			GM12U320_BLOCK_COUNT, cmd_draw, 0, 0);
+	if (ret)
+		return ret;
+
+	/*
+	 * Zero-copy sending of RGB888 fbs needs a host controller which can
+	 * handle sg entries which are not a multiple of the max packet size.
+	 */
+	if (gm12u320->udev->bus->no_sg_constraint &&
+	    gm12u320->udev->bus->sg_tablesize >= GM12U320_SG_MAX) {
+		gm12u320->sg.zero = kzalloc(GM12U320_SG_ZERO_SIZE, GFP_KERNEL);
+		if (!gm12u320->sg.zero)
+			return -ENOMEM;
+
+		for (set = 0; set < 2; set++) {
+			for (i = 0; i < GM12U320_BLOCK_COUNT; i++) {
+				gm12u320->sg.sgl[set][i] =
+					kmalloc_array(GM12U320_SG_MAX,
+						      sizeof(struct scatterlist),
+						      GFP_KERNEL);
+				if (!gm12u320->sg.sgl[set][i])
+					return -ENOMEM;
+			}
+		}
+		gm12u320->sg.supported = true;
+	}
+
+	gm12u320->fb_update.workq = create_singlethread_workqueue(DRIVER_NAME);
+	if (!gm12u320->fb_update.workq)
+		return -ENOMEM;
+	
+	return 0;
+}
+
+static void gm12u320_sg_put_fb(struct gm12u320_device *gm12u320, int set)
+{
+	struct drm_framebuffer *fb = gm12u320->sg.fb[set];
+
+	if (!fb)
+		return;
+
+	drm_gem_shmem_put_pages(to_drm_gem_shmem_obj(fb->obj[0]));
+	drm_framebuffer_put(fb);
+	gm12u320->sg.fb[set] = NULL;
+	gm12u320->sg.stale[set] = true;
+}
+
+static void gm12u320_usb_free(struct gm12u320_device *gm12u320)
+{
+	int i;
+
+	if (gm12u320->fb_update.workq)
+		destroy_workqueue(gm12u320->fb_update.workq);
+
+	gm12u320_sg_put_fb(gm12u320, 0);
+	gm12u320_sg_put_fb(gm12u320, 1);
+	if (gm12u320->fb_update.planes.overlay.fb)
+		drm_framebuffer_put(gm12u320->fb_update.planes.overlay.fb);
+	if (gm12u320->fb_update.planes.cursor.fb)
+		drm_framebuffer_put(gm12u320->fb_update.planes.cursor.fb);
+	gm12u320_color_put(gm12u320->fb_update.planes.color);
+
+	for (i = 0; i <= GM12U320_BLOCK_COUNT; i++)
+		gm12u320_xfer_free(&gm12u320->pipeline.xfer[i]);
+
+	for (i = 0; i < GM12U320_BLOCK_COUNT; i++) {
+		gm12u320_block_free(gm12u320->buf.pages[0][i],
+				    gm12u320->data_buf[0][i]);
+		gm12u320_block_free(gm12u320->buf.pages[1][i],
+				    gm12u320->data_buf[1][i]);
+		kfree(gm12u320->buf.sgl[0][i]);
+		kfree(gm12u320->buf.sgl[1][i]);
+		kfree(gm12u320->sg.sgl[0][i]);
+		kfree(gm12u320->sg.sgl[1][i]);
+	}
+	kfree(gm12u320->sg.zero);
+
+	kfree(gm12u320->cmd_buf);
+}
+
+static int gm12u320_misc_request(struct gm12u320_device *gm12u320,
+				 u8 req_a, u8 req_b,
+				 u8 arg_a, u8 arg_b, u8 arg_c, u8 arg_d)
+{
+	int ret, len;
+
+	memcpy(gm12u320->cmd_buf, &cmd_misc, CMD_SIZE);
+	gm12u320->cmd_buf[20] = req_a;
+	gm12u320->cmd_buf[21] = req_b;
+	gm12u320->cmd_buf[22] = arg_a;
+	gm12u320->cmd_buf[23] = arg_b;
+	gm12u320->cmd_buf[24] = arg_c;
+	gm12u320->cmd_buf[25] = arg_d;
+
+	/* Send request */
+	ret = usb_bulk_msg(gm12u320->udev,
+			   usb_sndbulkpipe(gm12u320->udev, gm12u320->ep.misc_snd),
+			   gm12u320->cmd_buf, CMD_SIZE, &len, CMD_TIMEOUT);
+	if (ret || len != CMD_SIZE) {
+		dev_err(&gm12u320->udev->dev, "Misc. req. error %d\n", ret);
+		return -EIO;
+	}
+
+	/* Read value */
+	ret = usb_bulk_msg(gm12u320->udev,
+			   usb_rcvbulkpipe(gm12u320->udev, gm12u320->ep.misc_rcv),
+			   gm12u320->cmd_buf, MISC_VALUE_SIZE, &len,
+			   DATA_TIMEOUT);
+	if (ret || len != MISC_VALUE_SIZE) {
+		dev_err(&gm12u320->udev->dev, "Misc. value error %d\n", ret);
+		return -EIO;
+	}
+	/* cmd_buf[0] now contains the read value, which we don't use */
+
+	/* Read status */
+	ret = usb_bulk_msg(gm12u320->udev,
+			   usb_rcvbulkpipe(gm12u320->udev, gm12u320->ep.misc_rcv),
+			   gm12u320->cmd_buf, READ_STATUS_SIZE, &len,
+			   CMD_TIMEOUT);
+	if (ret || len != READ_STATUS_SIZE) {
+		dev_err(&gm12u320->udev->dev, "Misc. status error %d\n", ret);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_X86
+/*
+ * Shuffle masks to pack 16 XRGB8888 pixels (4 source registers) into 48
+ * RGB888 bytes (3 destination registers), 2 masks per destination register.
+ */
+static const u8 gm12u320_ssse3_shuf[6][16] __aligned(16) = {
+	{  0,  1,  2,  4,  5,  6,  8,  9, 10, 12, 13, 14,
+	  0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	  0x80, 0x80, 0x80, 0x80,  0,  1,  2,  4 },
+	{  5,  6,  8,  9, 10, 12, 13, 14,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	   0,  1,  2,  4,  5,  6,  8,  9 },
+	{ 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80,  0,  1,  2,  4,
+	   5,  6,  8,  9, 10, 12, 13, 14 },
+};
+
+static bool gm12u320_ssse3_usable(void)
+{
+	return boot_cpu_has(X86_FEATURE_SSSE3);
+}
+
+static void gm12u320_32bpp_to_24bpp_ssse3(u8 *dst, const u8 *src, int len)
+{
+	kernel_fpu_begin();
+
+	for (; len >= 16; len -= 16, src += 64, dst += 48) {
+		asm volatile(
+			"movdqu    0(%[src]), %%xmm0\n\t"
+			"movdqu   16(%[src]), %%xmm1\n\t"
+			"movdqu   32(%[src]), %%xmm2\n\t"
+			"movdqu   48(%[src]), %%xmm3\n\t"
+			"movdqa   %%xmm1, %%xmm4\n\t"
+			"movdqa   %%xmm2, %%xmm5\n\t"
+			"pshufb    0(%[shuf]), %%xmm0\n\t"
+			"pshufb   16(%[shuf]), %%xmm4\n\t"
+			"pshufb   32(%[shuf]), %%xmm1\n\t"
+			"pshufb   48(%[shuf]), %%xmm5\n\t"
+			"pshufb   64(%[shuf]), %%xmm2\n\t"
+			"pshufb   80(%[shuf]), %%xmm3\n\t"
+			"por      %%xmm4, %%xmm0\n\t"
+			"por      %%xmm5, %%xmm1\n\t"
+			"por      %%xmm3, %%xmm2\n\t"
+			"movdqu   %%xmm0,  0(%[dst])\n\t"
+			"movdqu   %%xmm1, 16(%[dst])\n\t"
+			"movdqu   %%xmm2, 32(%[dst])\n\t"
+			:
+			: [src] "r" (src), [dst] "r" (dst),
+			  [shuf] "r" (gm12u320_ssse3_shuf)
+			: "memory");
+	}
+
+	kernel_fpu_end();
+
+	gm12u320_32bpp_to_24bpp_packed(dst, src, len);
+}
+
+#ifdef CONFIG_AS_AVX2
+/* Per 128 bit lane pack 4 pixels into the low 12 bytes */
+static const u8 gm12u320_avx2_shuf[32] __aligned(32) = {
+	 0,  1,  2,  4,  5,  6,  8,  9, 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80,
+	 0,  1,  2,  4,  5,  6,  8,  9, 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80,
+};
+
+/* Then move the 2 * 12 bytes next to each other */
+static const u32 gm12u320_avx2_perm[8] __aligned(32) = {
+	0, 1, 2, 4, 5, 6, 3, 7
+};
+
+static bool gm12u320_avx2_usable(void)
+{
+	/* The cpu supporting AVX2 is not enough, the OS must save YMM state */
+	return boot_cpu_has(X86_FEATURE_AVX) &&
+	       boot_cpu_has(X86_FEATURE_AVX2) &&
+	       cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+}
+
+static void gm12u320_32bpp_to_24bpp_avx2(u8 *dst, const u8 *src, int len)
+{
+	kernel_fpu_begin();
+
+	asm volatile("vmovdqa %0, %%ymm6" : : "m" (gm12u320_avx2_shuf[0]));
+	asm volatile("vmovdqa %0, %%ymm7" : : "m" (gm12u320_avx2_perm[0]));
+
+	for (; len >= 16; len -= 16, src += 64, dst += 48) {
+		asm volatile(
+			"vmovdqu      0(%[src]), %%ymm0\n\t"
+			"vmovdqu     32(%[src]), %%ymm1\n\t"
+			"vpshufb      %%ymm6, %%ymm0, %%ymm0\n\t"
+			"vpshufb      %%ymm6, %%ymm1, %%ymm1\n\t"
+			"vpermd       %%ymm0, %%ymm7, %%ymm0\n\t"
+			"vpermd       %%ymm1, %%ymm7, %%ymm1\n\t"
+			"vmovdqu      %%xmm0,  0(%[dst])\n\t"
+			"vextracti128 $1, %%ymm0, %%xmm0\n\t"
+			"vmovq        %%xmm0, 16(%[dst])\n\t"
+			"vmovdqu      %%xmm1, 24(%[dst])\n\t"
+			"vextracti128 $1, %%ymm1, %%xmm1\n\t"
+			"vmovq        %%xmm1, 40(%[dst])\n\t"
+			:
+			: [src] "r" (src), [dst] "r" (dst)
+			: "memory");
+	}
+
+	asm volatile("vzeroupper" : : : "memory");
+	kernel_fpu_end();
+
+	gm12u320_32bpp_to_24bpp_packed(dst, src, len);
+}
+#endif /* CONFIG_AS_AVX2 */
+#endif /* CONFIG_X86 */
+
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+static bool gm12u320_neon_usable(void)
+{
+	return system_supports_fpsimd();
+}
+
+static void gm12u320_32bpp_to_24bpp_neon(u8 *dst, const u8 *src, int len)
+{
+	kernel_neon_begin();
+
+	/* De-interleave 4 channels, re-interleave the first 3 */
+	for (; len >= 16; len -= 16) {
+		asm volatile(
+			"ld4 {v0.16b-v3.16b}, [%[src]], #64\n\t"
+			"st3 {v0.16b-v2.16b}, [%[dst]], #48\n\t"
+			: [src] "+r" (src), [dst] "+r" (dst)
+			:
+			: "memory", "v0", "v1", "v2", "v3");
+	}
+
+	kernel_neon_end();
+
+	gm12u320_32bpp_to_24bpp_packed(dst, src, len);
+}
+#endif
+
+struct gm12u320_convert_impl {
+	const char *name;
+	bool (*usable)(void);
+	void (*convert)(u8 *dst, const u8 *src, int len);
+};
+
+/* In order of preference, the scalar version must be last */
+static const struct gm12u320_convert_impl gm12u320_convert_impls[] = {
+#ifdef CONFIG_X86
+#ifdef CONFIG_AS_AVX2
+	{ "avx2", gm12u320_avx2_usable, gm12u320_32bpp_to_24bpp_avx2 },
+#endif
+	{ "ssse3", gm12u320_ssse3_usable, gm12u320_32bpp_to_24bpp_ssse3 },
+#endif
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+	{ "neon", gm12u320_neon_usable, gm12u320_32bpp_to_24bpp_neon },
+#endif
+	{ "scalar", NULL, gm12u320_32bpp_to_24bpp_packed },
+};
+
+static void (*gm12u320_32bpp_to_24bpp)(u8 *dst, const u8 *src, int len) =
+	gm12u320_32bpp_to_24bpp_packed;
+
+/* Indexed by enum drm_color_encoding and enum drm_color_range */
+static const struct gm12u320_yuv_coeffs gm12u320_yuv_coeffs[2][2] = {
+	[DRM_COLOR_YCBCR_BT601] = {
+		[DRM_COLOR_YCBCR_LIMITED_RANGE] =
+			{ 16, 76309, 104597, 25675, 53279, 132201 },
+		[DRM_COLOR_YCBCR_FULL_RANGE] =
+			{ 0, 65536, 91881, 22553, 46802, 116130 },
+	},
+	[DRM_COLOR_YCBCR_BT709] = {
+		[DRM_COLOR_YCBCR_LIMITED_RANGE] =
+			{ 16, 76309, 117489, 13975, 34925, 138438 },
+		[DRM_COLOR_YCBCR_FULL_RANGE] =
+			{ 0, 65536, 103206, 12276, 30679, 121609 },
+	},
+};
+
+static void gm12u320_color_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct gm12u320_color, ref));
+}
+
+static void gm12u320_color_put(struct gm12u320_color *color)
+{
+	if (color)
+		kref_put(&color->ref, gm12u320_color_release);
+}
+
+/* CTM coefficients are S31.32 sign-magnitude, return them in 24.8 */
+static s32 gm12u320_ctm_coeff(u64 coeff)
+{
+	s64 val = min_t(u64, (coeff & ~BIT_ULL(63)) >> 24, S32_MAX / 1024);
+
+	return (coeff & BIT_ULL(63)) ? -val : val;
+}
+
+static bool gm12u320_color_gamma_is_identity(const struct gm12u320_color *color)
+{
+	int c, v;
+
+	for (c = 0; c < 3; c++) {
+		for (v = 0; v < 256; v++) {
+			if (color->gamma[c][v] != v)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Bake the GAMMA_LUT and CTM of a CRTC state into lookup tables, so that
+ * applying them costs a few table lookups per pixel. Returns NULL for the
+ * identity, including linear LUTs and identity matrices as commonly set by
+ * compositors, so that conversion can skip the lookups entirely.
+ */
+static struct gm12u320_color *
+gm12u320_color_create(const struct drm_crtc_state *state)
+{
+	const struct drm_color_lut *lut;
+	const struct drm_color_ctm *ctm;
+	struct gm12u320_color *color;
+	int i, j, v, size, coeff;
+
+	if (!state->gamma_lut && !state->ctm)
+		return NULL;
+
+	color = kmalloc(sizeof(*color), GFP_KERNEL);
+	if (!color)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&color->ref);
+
+	for (v = 0; v < 256; v++) {
+		if (!state->gamma_lut) {
+			color->gamma[0][v] = v;
+			color->gamma[1][v] = v;
+			color->gamma[2][v] = v;
+			continue;
+		}
+
+		lut = state->gamma_lut->data;
+		size = drm_color_lut_size(state->gamma_lut);
+		lut += DIV_ROUND_CLOSEST(v * (size - 1), 255);
+		color->gamma[0][v] = drm_color_lut_extract(lut->blue, 8);
+		color->gamma[1][v] = drm_color_lut_extract(lut->green, 8);
+		color->gamma[2][v] = drm_color_lut_extract(lut->red, 8);
+	}
+
+	color->ctm = false;
+	if (state->ctm) {
+		/* The matrix rows and columns are in R, G, B order */
+		ctm = state->ctm->data;
+		for (i = 0; i < 3; i++) {
+			for (j = 0; j < 3; j++) {
+				coeff = gm12u320_ctm_coeff(
+					ctm->matrix[(2 - i) * 3 + (2 - j)]);
+				/* Only 1.0 on the diagonal is a no-op */
+				if (coeff != (i == j ? 256 : 0))
+					color->ctm = true;
+				for (v = 0; v < 256; v++)
+					color->ctm_lut[i][j][v] = coeff * v;
+			}
+		}
+	}
+
+	if (!color->ctm && gm12u320_color_gamma_is_identity(color)) {
+		kfree(color);
+		return NULL;
+	}
+
+	return color;
+}
+
+#define CONVERT_TEST_PIXELS		(GM12U320_USER_WIDTH + 64)
+#define CONVERT_TEST_GUARD		16
+
+/*
+ * Check that an accelerated variant produces bit-identical output to the
+ * scalar version, for all lengths around the vector widths, for a full
+ * line and with misaligned source and destination pointers.
+ */
+static bool gm12u320_convert_test(const struct gm12u320_convert_impl *impl,
+				  u8 *src, u8 *ref, u8 *out)
+{
+	int i, len, offset;
+
+	for (i = 0; i < CONVERT_TEST_PIXELS * 4; i++)
+		src[i] = i * 7 + (i >> 8);
+
+	for (offset = 0; offset < 4; offset++) {
+		for (len = 0; len <= CONVERT_TEST_PIXELS - 4; len++) {
+			if (len > 80 && len != GM12U320_USER_WIDTH)
+				continue;
+
+			memset(ref, 0x5a, CONVERT_TEST_PIXELS * 3 +
+					  CONVERT_TEST_GUARD);
+			memset(out, 0x5a, CONVERT_TEST_PIXELS * 3 +
+					  CONVERT_TEST_GUARD);
+			gm12u320_32bpp_to_24bpp_packed(ref + offset,
+						       src + offset * 4, len);
+			impl->convert(out + offset, src + offset * 4, len);
+			if (memcmp(ref, out, CONVERT_TEST_PIXELS * 3 +
+					     CONVERT_TEST_GUARD))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void gm12u320_select_convert(void)
+{
+	const struct gm12u320_convert_impl *impl;
+	u8 *src, *ref, *out;
+	int i;
+
+	src = kmalloc(CONVERT_TEST_PIXELS * 4, GFP_KERNEL);
+	ref = kmalloc(CONVERT_TEST_PIXELS * 3 + CONVERT_TEST_GUARD, GFP_KERNEL);
+	out = kmalloc(CONVERT_TEST_PIXELS * 3 + CONVERT_TEST_GUARD, GFP_KERNEL);
+	if (!src || !ref || !out)
+		goto out;
+
+	for (i = 0; i < ARRAY_SIZE(gm12u320_convert_impls) - 1; i++) {
+		impl = &gm12u320_convert_impls[i];
+
+		if (!impl->usable())
+			continue;
+
+		if (!gm12u320_convert_test(impl, src, ref, out)) {
+			pr_err(DRIVER_NAME ": %s pixel conversion self-test failed\n",
+			       impl->name);
+			continue;
+		}
+
+		gm12u320_32bpp_to_24bpp = impl->convert;
+		pr_info(DRIVER_NAME ": using %s pixel conversion\n", impl->name);
+		break;
+	}
+out:
+	kfree(out);
+	kfree(ref);
+	kfree(src);
+}
+
+static int gm12u320_fb_begin_cpu_access(struct drm_framebuffer *fb)
+{
+	struct dma_buf_attachment *attach = fb->obj[0]->import_attach;
+
+	if (!attach)
+		return 0;
+
+	return dma_buf_begin_cpu_access(attach->dmabuf, DMA_FROM_DEVICE);
+}
+
+static int gm12u320_fb_end_cpu_access(struct drm_framebuffer *fb)
+{
+	struct dma_buf_attachment *attach = fb->obj[0]->import_attach;
+
+	if (!attach)
+		return 0;
+
+	return dma_buf_end_cpu_access(attach->dmabuf, DMA_FROM_DEVICE);
+}
+
+static void *gm12u320_fb_begin_access(struct drm_framebuffer *fb)
+{
+	void *vaddr = to_gm12u320_fb(fb)->vaddr;
+	int ret;
+
+	/* Only fbs which went through gm12u320_plane_prepare_fb() get here */
+	if (WARN_ON(!vaddr))
+		return NULL;
+
+	ret = gm12u320_fb_begin_cpu_access(fb);
+	if (ret) {
+		DRM_ERROR("dma_buf_begin_cpu_access err: %d\n", ret);
+		return NULL;
+	}
+
+	return vaddr;
+}
+
+static void gm12u320_fb_end_access(struct drm_framebuffer *fb, void *vaddr)
+{
+	int ret;
+
+	ret = gm12u320_fb_end_cpu_access(fb);
+	if (ret)
+		DRM_ERROR("dma_buf_end_cpu_access err: %d\n", ret);
+}
+
+/*
+ * Convert the part of rect which lands in data blocks first_block up to and
+ * including last_block.
+ *
+ * rect is in screen coordinates, reflections are done by walking the fb
+ * backwards, so that they do not cost an extra pass. Neither does the color
+ * correction, with it the (not SIMD) converters which apply it to each pixel
+ * as they convert it get used.
+ */
+static void gm12u320_convert_blocks(struct gm12u320_device *gm12u320,
+				    int set, struct drm_framebuffer *fb,
+				    const u8 *vaddr,
+				    const struct gm12u320_planes *planes,
+				    const struct drm_rect *rect,
+				    int first_block, int last_block)
+{
+	const unsigned int rotation = planes->rotation;
+	const bool reflect_x = rotation & DRM_MODE_REFLECT_X;
+	const int cpp = fb->format->cpp[0];
+	const int step = reflect_x ? -cpp : cpp;
+	void (*convert)(u8 *dst, const u8 *src, int len);
+	void (*convert_color)(u8 *dst, const u8 *src, int len, int step,
+			      const struct gm12u320_color *color);
+	struct gm12u320_run_iter iter;
+	struct gm12u320_run run;
+	const u8 *src;
+	int sx, sy;
+	u8 *out;
+
+	switch (fb->format->format) {
+	case DRM_FORMAT_RGB888:
+		convert = reflect_x ? gm12u320_24bpp_reversed :
+				      gm12u320_24bpp_copy;
+		convert_color = gm12u320_bgr_to_24bpp_color;
+		break;
+	case DRM_FORMAT_XBGR8888:
+		convert = reflect_x ? gm12u320_xbgr8888_to_24bpp_reversed :
+				      gm12u320_xbgr8888_to_24bpp;
+		convert_color = gm12u320_rgb_to_24bpp_color;
+		break;
+	case DRM_FORMAT_RGB565:
+		convert = reflect_x ? gm12u320_rgb565_to_24bpp_reversed :
+				      gm12u320_rgb565_to_24bpp;
+		convert_color = gm12u320_rgb565_to_24bpp_color;
+		break;
+	default:
+		/* XRGB8888 and ARGB8888, alpha is ignored */
+		convert = reflect_x ? gm12u320_32bpp_to_24bpp_reversed :
+				      gm12u320_32bpp_to_24bpp;
+		convert_color = gm12u320_bgr_to_24bpp_color;
+		break;
+	}
+
+	gm12u320_run_iter_init(&iter, rect, first_block, last_block);
+	while (gm12u320_run_iter_next(&iter, &run)) {
+		sx = reflect_x ? GM12U320_USER_WIDTH - 1 - run.x : run.x;
+		sy = (rotation & DRM_MODE_REFLECT_Y) ?
+		     GM12U320_HEIGHT - 1 - run.y : run.y;
+		out = gm12u320->data_buf[set][run.block] +
+		      DATA_BLOCK_HEADER_SIZE + run.offset;
+
+		src = vaddr + fb->offsets[0] + sy * fb->pitches[0] + sx * cpp;
+		if (planes->color)
+			convert_color(out, src, run.len, step, planes->color);
+		else
+			convert(out, src, run.len);
+	}
+}
+
+/* Like gm12u320_convert_blocks(), for a rect within the overlay */
+static void gm12u320_convert_overlay_blocks(struct gm12u320_device *gm12u320,
+				int set, const struct gm12u320_planes *planes,
+				const struct drm_rect *rect,
+				int first_block, int last_block)
+{
+	const struct gm12u320_plane *overlay = &planes->overlay;
+	const struct drm_framebuffer *fb = overlay->fb;
+	struct gm12u320_run_iter iter;
+	struct gm12u320_run run;
+	const u8 *luma, *chroma;
+	int x, sy;
+	u8 *out;
+
+	gm12u320_run_iter_init(&iter, rect, first_block, last_block);
+	while (gm12u320_run_iter_next(&iter, &run)) {
+		x = overlay->src_x + run.x - overlay->dst.x1;
+		sy = overlay->src_y + run.y - overlay->dst.y1;
+		luma = overlay->vaddr + fb->offsets[0] + sy * fb->pitches[0];
+		out = gm12u320->data_buf[set][run.block] +
+		      DATA_BLOCK_HEADER_SIZE + run.offset;
+
+		if (fb->format->format == DRM_FORMAT_NV12) {
+			chroma = overlay->vaddr + fb->offsets[1] +
+				 sy / 2 * fb->pitches[1];
+			gm12u320_yuv_to_24bpp(out, luma, 1, chroma,
+					      chroma + 1, 2, x, run.len,
+					      overlay->coeffs, planes->color);
+		} else { /* YUYV */
+			gm12u320_yuv_to_24bpp(out, luma, 2, luma + 1,
+					      luma + 3, 4, x, run.len,
+					      overlay->coeffs, planes->color);
+		}
+	}
+}
+
+/*
+ * Convert a damaged rect, taking each pixel from either the primary fb or
+ * the overlay, so that the pixels below the overlay are never converted.
+ */
+static void gm12u320_convert_rect(struct gm12u320_device *gm12u320, int set,
+				  struct drm_framebuffer *fb, const u8 *vaddr,
+				  const struct gm12u320_planes *planes,
+				  const struct drm_rect *rect,
+				  int first_block, int last_block)
+{
+	const struct gm12u320_plane *overlay = &planes->overlay;
+	struct drm_rect ov, parts[4];
+	int i;
+
+	ov = overlay->dst;
+	if (!overlay->vaddr || !drm_rect_intersect(&ov, rect)) {
+		gm12u320_convert_blocks(gm12u320, set, fb, vaddr, planes,
+					rect, first_block, last_block);
+		return;
+	}
+
+	/* Above, left of, right of and below the overlay */
+	parts[0] = (struct drm_rect) { rect->x1, rect->y1, rect->x2, ov.y1 };
+	parts[1] = (struct drm_rect) { rect->x1, ov.y1, ov.x1, ov.y2 };
+	parts[2] = (struct drm_rect) { ov.x2, ov.y1, rect->x2, ov.y2 };
+	parts[3] = (struct drm_rect) { rect->x1, ov.y2, rect->x2, rect->y2 };
+
+	for (i = 0; i < ARRAY_SIZE(parts); i++) {
+		if (drm_rect_visible(&parts[i]))
+			gm12u320_convert_blocks(gm12u320, set, fb, vaddr,
+						planes, &parts[i],
+						first_block, last_block);
+	}
+
+	gm12u320_convert_overlay_blocks(gm12u320, set, planes, &ov,
+					first_block, last_block);
+}
+
+/*
+ * Blend the (premultiplied alpha) cursor over the converted pixels. Damage
+ * rects may overlap, so this is done once for all of them, after they have
+ * been converted and only for the pixels which have been converted.
+ *
+ * The pixels below the cursor already are color corrected, so the cursor
+ * gets corrected before blending. This is exact for opaque cursor pixels.
+ */
+static void gm12u320_blend_cursor(struct gm12u320_device *gm12u320, int set,
+				  const struct gm12u320_planes *planes,
+				  const struct gm12u320_damage *damage,
+				  int first_block, int last_block)
+{
+	const int x_offset = (GM12U320_REAL_WIDTH - GM12U320_USER_WIDTH) / 2;
+	const struct gm12u320_plane *cursor = &planes->cursor;
+	const struct drm_framebuffer *fb = cursor->fb;
+	int start = first_block * DATA_BLOCK_CONTENT_SIZE;
+	int end = (last_block + 1) * DATA_BLOCK_CONTENT_SIZE;
+	int x, y, dst, alpha;
+	const u8 *src;
+	u8 pixel[3];
+	u8 *out;
+
+	if (!cursor->vaddr)
+		return;
+
+	for (y = cursor->dst.y1; y < cursor->dst.y2; y++) {
+		src = cursor->vaddr + fb->offsets[0] +
+		      (cursor->src_y + y - cursor->dst.y1) * fb->pitches[0] +
+		      cursor->src_x * 4;
+
+		for (x = cursor->dst.x1; x < cursor->dst.x2; x++, src += 4) {
+			dst = (y * GM12U320_REAL_WIDTH + x + x_offset) * 3;
+			if (dst < start || dst >= end || !src[3] ||
+			    !gm12u320_damage_contains(damage, x, y))
+				continue;
+
+			out = gm12u320->data_buf[set][dst / DATA_BLOCK_CONTENT_SIZE] +
+			      DATA_BLOCK_HEADER_SIZE +
+			      dst % DATA_BLOCK_CONTENT_SIZE;
+			memcpy(pixel, src, 3);
+			if (planes->color)
+				gm12u320_color_apply(planes->color, pixel, 1);
+			alpha = 255 - src[3];
+			out[0] = min(255, pixel[0] + (out[0] * alpha + 127) / 255);
+			out[1] = min(255, pixel[1] + (out[1] * alpha + 127) / 255);
+			out[2] = min(255, pixel[2] + (out[2] * alpha + 127) / 255);
+		}
+	}
+}
+
+static void gm12u320_plane_begin_access(struct gm12u320_plane *plane)
+{
+	if (plane->fb)
+		plane->vaddr = gm12u320_fb_begin_access(plane->fb);
+}
+
+static void gm12u320_plane_end_access(struct gm12u320_plane *plane)
+{
+	if (plane->vaddr) {
+		gm12u320_fb_end_access(plane->fb, (void *)plane->vaddr);
+		plane->vaddr = NULL;
+	}
+}
+
+/*
+ * Fill the sg list of a data block with the header and footer from the
+ * block's data_buf, with the lines in between pointing straight into the
+ * pages of an RGB888 fb.
+ */
+static void gm12u320_sg_fill_block(struct gm12u320_device *gm12u320,
+				   int set, int block,
+				   struct drm_framebuffer *fb,
+				   struct page **pages)
+{
+	const int line_size = GM12U320_REAL_WIDTH * 3;
+	const int pad = GM12U320_PAD_SIZE;
+	const int row_size = GM12U320_USER_WIDTH * 3;
+	struct scatterlist *sg = gm12u320->sg.sgl[set][block];
+	u8 *buf = gm12u320->data_buf[set][block];
+	int start = block * DATA_BLOCK_CONTENT_SIZE;
+	int end = min(start + DATA_BLOCK_CONTENT_SIZE,
+		      line_size * GM12U320_HEIGHT);
+	int pos, x, y, len, offset, n = 0;
+
+	sg_init_table(sg, GM12U320_SG_MAX);
+	n += gm12u320_sg_set_data(&sg[n], buf, DATA_BLOCK_HEADER_SIZE);
+
+	for (pos = start; pos < end; pos += len) {
+		y = pos / line_size;
+		x = pos % line_size;
+
+		if (x < pad || x >= pad + row_size) {
+			/* The right padding of a line and left of the next */
+			len = (x < pad) ? pad - x : line_size - x + pad;
+			len = min(len, end - pos);
+			if (WARN_ON_ONCE(len > GM12U320_SG_ZERO_SIZE))
+				len = GM12U320_SG_ZERO_SIZE;
+			sg_set_buf(&sg[n++], gm12u320->sg.zero, len);
+			continue;
+		}
+
+		offset = fb->offsets[0] + y * fb->pitches[0] + x - pad;
+		len = min3(pad + row_size - x, end - pos,
+			   (int)(PAGE_SIZE - offset_in_page(offset)));
+		sg_set_page(&sg[n++], pages[offset >> PAGE_SHIFT], len,
+			    offset_in_page(offset));
+	}
+
+	n += gm12u320_sg_set_data(&sg[n],
+				  buf + (end - start) + DATA_BLOCK_HEADER_SIZE,
+				  DATA_BLOCK_FOOTER_SIZE);
+	sg_mark_end(&sg[n - 1]);
+	gm12u320->sg.nents[set][block] = n;
+}
+
+/*
+ * Try to make the data blocks of a set point straight into the pages of fb,
+ * returns false if the fb needs to be converted into data_buf instead.
+ */
+static bool gm12u320_sg_set_fb(struct gm12u320_device *gm12u320, int set,
+			       struct drm_framebuffer *fb)
+{
+	struct drm_gem_object *obj = fb->obj[0];
+	struct drm_gem_shmem_object *shmem = to_drm_gem_shmem_obj(obj);
+	int block;
+
+	gm12u320_sg_put_fb(gm12u320, set);
+
+	if (!gm12u320->sg.supported ||
+	    fb->format->format != DRM_FORMAT_RGB888 || obj->import_attach)
+		return false;
+
+	/* Keep the pages around for as long as we may (re)send them */
+	if (drm_gem_shmem_get_pages(shmem))
+		return false;
+
+	for (block = 0; block < GM12U320_BLOCK_COUNT; block++)
+		gm12u320_sg_fill_block(gm12u320, set, block, fb,
+				       shmem->pages);
+
+	drm_framebuffer_get(fb);
+	gm12u320->sg.fb[set] = fb;
+	return true;
+}
+
+/* Convert the part of damage which lands in first_block - last_block */
+static void gm12u320_convert_range(struct gm12u320_device *gm12u320, int set,
+				   struct drm_framebuffer *fb, const u8 *vaddr,
+				   const struct gm12u320_planes *planes,
+				   const struct gm12u320_damage *damage,
+				   int first_block, int last_block)
+{
+	int i;
+
+	for (i = 0; i < damage->count; i++)
+		gm12u320_convert_rect(gm12u320, set, fb, vaddr, planes,
+				      &damage->rects[i], first_block,
+				      last_block);
+	gm12u320_blend_cursor(gm12u320, set, planes, damage,
+			      first_block, last_block);
+}
+
+static void gm12u320_convert_job_work(struct work_struct *work)
+{
+	struct gm12u320_convert_job *job =
+		container_of(work, struct gm12u320_convert_job, work);
+
+	gm12u320_convert_range(job->gm12u320, job->set, job->fb, job->vaddr,
+			       job->planes, job->damage, job->first_block,
+			       job->last_block);
+}
+
+/*
+ * The data blocks are independent, so large damage gets split into ranges
+ * of blocks which are converted in parallel on the unbound workqueue, while
+ * the worker converts the first range itself.
+ */
+static void gm12u320_copy_fb_to_blocks(struct gm12u320_device *gm12u320,
+				       int set, struct drm_framebuffer *fb,
+				       struct gm12u320_planes *planes,
+				       const struct gm12u320_damage *damage)
+{
+	struct gm12u320_convert_job *job;
+	int i, first, last, per_job, jobs = 1, area = 0;
+	u32 blocks;
+	void *vaddr;
+
+	blocks = gm12u320_damage_blocks(damage);
+	if (!blocks)
+		return;
+
+	first = __ffs(blocks);
+	last = __fls(blocks);
+
+	for (i = 0; i < damage->count; i++)
+		area += gm12u320_rect_area(&damage->rects[i]);
+	if (area >= GM12U320_PARALLEL_MIN_PIXELS)
+		jobs = min_t(int, num_online_cpus(), GM12U320_CONVERT_JOBS);
+
+	per_job = DIV_ROUND_UP(last - first + 1, jobs);
+	jobs = DIV_ROUND_UP(last - first + 1, per_job);
+
+	vaddr = gm12u320_fb_begin_access(fb);
+	if (!vaddr)
+		return;
+
+	gm12u320_plane_begin_access(&planes->overlay);
+	gm12u320_plane_begin_access(&planes->cursor);
+
+	for (i = 1; i < jobs; i++) {
+		job = &gm12u320->fb_update.jobs[i - 1];
+		job->set = set;
+		job->fb = fb;
+		job->vaddr = vaddr;
+		job->planes = planes;
+		job->damage = damage;
+		job->first_block = first + i * per_job;
+		job->last_block = min(job->first_block + per_job - 1, last);
+		queue_work(system_unbound_wq, &job->work);
+	}
+
+	gm12u320_convert_range(gm12u320, set, fb, vaddr, planes, damage,
+			       first, first + per_job - 1);
+
+	for (i = 1; i < jobs; i++)
+		flush_work(&gm12u320->fb_update.jobs[i - 1].work);
+
+	if (jobs > 1)
+		gm12u320->stats.parallel_converts++;
+
+	gm12u320_plane_end_access(&planes->cursor);
+	gm12u320_plane_end_access(&planes->overlay);
+	gm12u320_fb_end_access(fb, vaddr);
+}
+
+static void gm12u320_planes_get(struct gm12u320_planes *planes)
+{
+	if (planes->overlay.fb)
+		drm_framebuffer_get(planes->overlay.fb);
+	if (planes->cursor.fb)
+		drm_framebuffer_get(planes->cursor.fb);
+	if (planes->color)
+		kref_get(&planes->color->ref);
+}
+
+/* This also clears the references, so that it may be called again */
+static void gm12u320_planes_put(struct gm12u320_planes *planes)
+{
+	if (planes->overlay.fb)
+		drm_framebuffer_put(planes->overlay.fb);
+	if (planes->cursor.fb)
+		drm_framebuffer_put(planes->cursor.fb);
+	gm12u320_color_put(planes->color);
+
+	planes->overlay.fb = NULL;
+	planes->cursor.fb = NULL;
+	planes->color = NULL;
+}
+
+static bool gm12u320_plane_equal(const struct gm12u320_plane *a,
+				 const struct gm12u320_plane *b)
+{
+	return a->fb == b->fb && a->src_x == b->src_x &&
+	       a->src_y == b->src_y && drm_rect_equals(&a->dst, &b->dst);
+}
+
+static void gm12u320_hash_keep_plane(unsigned long *keep,
+				     const struct gm12u320_plane *plane)
+{
+	if (plane->fb)
+		bitmap_set(keep, plane->dst.y1, drm_rect_height(&plane->dst));
+}
+
+/* Forget all row hashes, e.g. after the fb got converted without hashing */
+static void gm12u320_hash_invalidate(struct gm12u320_device *gm12u320)
+{
+	bitmap_zero(gm12u320->hash.hashed, GM12U320_HEIGHT);
+	gm12u320_planes_put(&gm12u320->hash.planes);
+}
+
+/*
+ * Some clients damage the entire frame on every update. Hash the damaged
+ * rows of the fb and drop the rows which hash the same as the content they
+ * were last converted from. The hash covers the entire row, but content
+ * outside of the damage did not change, so the kept rows keep the width of
+ * their damage rects. The rows below the overlay and cursor are always kept,
+ * since their contents are not hashed, and nothing gets dropped when the
+ * plane state changed since the last frame. The last plane state is held
+ * with references, so that its pointers cannot get reused by new objects.
+ */
+static void gm12u320_damage_refine(struct gm12u320_device *gm12u320,
+				   struct drm_framebuffer *fb,
+				   struct gm12u320_planes *planes,
+				   struct gm12u320_damage *damage)
+{
+	const struct gm12u320_planes *last = &gm12u320->hash.planes;
+	DECLARE_BITMAP(damaged, GM12U320_HEIGHT);
+	DECLARE_BITMAP(keep, GM12U320_HEIGHT);
+	struct gm12u320_damage refined = {};
+	int i, y, y2, sy;
+	u8 *vaddr;
+	u64 hash;
+
+	if (!gm12u320_plane_equal(&planes->overlay, &last->overlay) ||
+	    !gm12u320_plane_equal(&planes->cursor, &last->cursor) ||
+	    planes->rotation != last->rotation ||
+	    planes->color != last->color)
+		bitmap_zero(gm12u320->hash.hashed, GM12U320_HEIGHT);
+
+	gm12u320_planes_get(planes);
+	gm12u320_planes_put(&gm12u320->hash.planes);
+	gm12u320->hash.planes = *planes;
+
+	vaddr = gm12u320_fb_begin_access(fb);
+	if (!vaddr) {
+		bitmap_zero(gm12u320->hash.hashed, GM12U320_HEIGHT);
+		return;
+	}
+
+	bitmap_zero(damaged, GM12U320_HEIGHT);
+	bitmap_zero(keep, GM12U320_HEIGHT);
+	for (i = 0; i < damage->count; i++)
+		bitmap_set(damaged, damage->rects[i].y1,
+			   drm_rect_height(&damage->rects[i]));
+
+	for_each_set_bit(y, damaged, GM12U320_HEIGHT) {
+		sy = (planes->rotation & DRM_MODE_REFLECT_Y) ?
+		     GM12U320_HEIGHT - 1 - y : y;
+		hash = xxh64(vaddr + fb->offsets[0] + sy * fb->pitches[0],
+			     GM12U320_USER_WIDTH * fb->format->cpp[0],
+			     fb->format->format);
+		if (test_bit(y, gm12u320->hash.hashed) &&
+		    hash == gm12u320->hash.rows[y]) {
+			gm12u320->stats.hash_rows_unchanged++;
+		} else {
+			gm12u320->hash.rows[y] = hash;
+			set_bit(y, gm12u320->hash.hashed);
+			set_bit(y, keep);
+		}
+		gm12u320->stats.hash_rows++;
+	}
+
+	gm12u320_fb_end_access(fb, vaddr);
+
+	gm12u320_hash_keep_plane(keep, &planes->overlay);
+	gm12u320_hash_keep_plane(keep, &planes->cursor);
+	bitmap_and(keep, keep, damaged, GM12U320_HEIGHT);
+
+	for (i = 0; i < damage->count; i++) {
+		const struct drm_rect *rect = &damage->rects[i];
+
+		y = rect->y1;
+		while ((y = find_next_bit(keep, rect->y2, y)) < rect->y2) {
+			y2 = find_next_zero_bit(keep, rect->y2, y);
+			gm12u320_damage_add(&refined, &(struct drm_rect) {
+					    rect->x1, y, rect->x2, y2 });
+			y = y2;
+		}
+	}
+
+	*damage = refined;
+}
+
+/*
+ * The device has no vblank irq, so vblanks come from a timer running at the
+ * rate at which we can send full frames. Flip events are held until the
+ * draw command of their frame has been acknowledged, at which point a vblank
+ * is signalled right away, so that the event gets the delivery time as its
+ * timestamp. The timer skips its next tick when it comes too soon after such
+ * a delivery vblank.
+ */
+static enum hrtimer_restart gm12u320_vblank_timer(struct hrtimer *timer)
+{
+	struct gm12u320_device *gm12u320 =
+		container_of(timer, struct gm12u320_device, vblank.timer);
+	u32 period_ns = READ_ONCE(gm12u320->vblank.period_ns);
+	ktime_t now = hrtimer_cb_get_time(timer);
+
+	if (!READ_ONCE(gm12u320->vblank.enabled))
+		return HRTIMER_NORESTART;
+
+	if (ktime_to_ns(ktime_sub(now, READ_ONCE(gm12u320->vblank.last))) >=
+	    period_ns / 2) {
+		WRITE_ONCE(gm12u320->vblank.last, now);
+		drm_crtc_handle_vblank(&gm12u320->pipe.crtc);
+	}
+
+	hrtimer_forward_now(timer, ns_to_ktime(period_ns));
+	return HRTIMER_RESTART;
+}
+
+/* Send a held flip event, without its frame having been drawn */
+static void gm12u320_send_vblank_event(struct gm12u320_device *gm12u320,
+				       struct drm_pending_vblank_event *event)
+{
+	struct drm_crtc *crtc = &gm12u320->pipe.crtc;
+	unsigned long flags;
+
+	spin_lock_irqsave(&crtc->dev->event_lock, flags);
+	drm_crtc_send_vblank_event(crtc, event);
+	spin_unlock_irqrestore(&crtc->dev->event_lock, flags);
+	drm_crtc_vblank_put(crtc);
+}
+
+/* Have the vblank timer send a held flip event, for an unchanged frame */
+static void gm12u320_arm_vblank_event(struct gm12u320_device *gm12u320,
+				      struct drm_pending_vblank_event *event)
+{
+	struct drm_crtc *crtc = &gm12u320->pipe.crtc;
+	unsigned long flags;
+
+	/* This takes over the vblank reference held for the event */
+	spin_lock_irqsave(&crtc->dev->event_lock, flags);
+	drm_crtc_arm_vblank_event(crtc, event);
+	spin_unlock_irqrestore(&crtc->dev->event_lock, flags);
+}
+
+/* Signal a vblank for a drawn frame, completing its flip event */
+static void gm12u320_deliver_vblank_event(struct gm12u320_device *gm12u320,
+					  struct drm_pending_vblank_event *event)
+{
+	struct drm_crtc *crtc = &gm12u320->pipe.crtc;
+	unsigned long flags;
+
+	/* This takes over the vblank reference held for the event */
+	spin_lock_irqsave(&crtc->dev->event_lock, flags);
+	drm_crtc_arm_vblank_event(crtc, event);
+	spin_unlock_irqrestore(&crtc->dev->event_lock, flags);
+
+	WRITE_ONCE(gm12u320->vblank.last, ktime_get());
+	drm_crtc_handle_vblank(crtc);
+}
+
+/*
+ * The pending fb does not get taken until the fences of all planes have
+ * signalled, the fence callbacks wake up the worker for this.
+ */
+static void gm12u320_fence_signalled(struct dma_fence *fence,
+				     struct dma_fence_cb *cb)
+{
+	struct gm12u320_fence *slot = container_of(cb, struct gm12u320_fence,
+						   cb);
+
+	wake_up(&slot->gm12u320->fb_update.waitq);
+}
+
+/* Called with fb_update.lock held */
+static void gm12u320_fb_update_set_fence(struct gm12u320_device *gm12u320,
+					 int slot, struct dma_fence *fence)
+{
+	struct gm12u320_fence *f = &gm12u320->fb_update.fences[slot];
+
+	if (f->fence) {
+		dma_fence_remove_callback(f->fence, &f->cb);
+		dma_fence_put(f->fence);
+		f->fence = NULL;
+	}
+
+	if (!fence)
+		return;
+
+	if (dma_fence_add_callback(fence, &f->cb, gm12u320_fence_signalled)) {
+		/* Already signalled */
+		dma_fence_put(fence);
+		return;
+	}
+
+	f->fence = fence;
+}
+
+/* Called with fb_update.lock held */
+static void gm12u320_fb_update_clear_fences(struct gm12u320_device *gm12u320)
+{
+	int i;
+
+	for (i = 0; i < GM12U320_FENCE_SLOTS; i++)
+		gm12u320_fb_update_set_fence(gm12u320, i, NULL);
+}
+
+static bool gm12u320_fb_update_fenced(struct gm12u320_device *gm12u320)
+{
+	struct dma_fence *fence;
+	int i;
+
+	for (i = 0; i < GM12U320_FENCE_SLOTS; i++) {
+		fence = gm12u320->fb_update.fences[i].fence;
+		if (fence && !dma_fence_is_signaled(fence))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Take the pending fb, its damage and its flip event, plus the overlay and
+ * cursor state to go with it. The lock is only held for this, so that
+ * gm12u320_fb_mark_dirty() never waits for a conversion to finish. The
+ * caller owns the returned fb and plane fb references and the event.
+ */
+static struct drm_framebuffer *
+gm12u320_fb_update_take(struct gm12u320_device *gm12u320,
+			struct gm12u320_damage *damage,
+			struct drm_pending_vblank_event **event,
+			struct gm12u320_planes *planes)
+{
+	struct drm_framebuffer *fb;
+
+	planes->overlay.fb = NULL;
+	planes->cursor.fb = NULL;
+	planes->color = NULL;
+
+	mutex_lock(&gm12u320->fb_update.lock);
+	if (gm12u320_fb_update_fenced(gm12u320)) {
+		mutex_unlock(&gm12u320->fb_update.lock);
+		*event = NULL;
+		return NULL;
+	}
+	gm12u320_fb_update_clear_fences(gm12u320);
+	fb = gm12u320_pending_take(&gm12u320->fb_update.pending, damage, event);
+	if (fb) {
+		*planes = gm12u320->fb_update.planes;
+		gm12u320_planes_get(planes);
+	}
+	mutex_unlock(&gm12u320->fb_update.lock);
+
+	return fb;
+}
+
+static int gm12u320_fb_update_ready(struct gm12u320_device *gm12u320)
+{
+	int ret;
+
+	mutex_lock(&gm12u320->fb_update.lock);
+	ret = !gm12u320->fb_update.run ||
+	      (gm12u320->fb_update.pending.fb &&
+	       !gm12u320_fb_update_fenced(gm12u320));
+	mutex_unlock(&gm12u320->fb_update.lock);
+
+	return ret;
+}
+
+static void gm12u320_hist_add(u32 *hist, s64 us)
+{
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	hist[min(bucket, GM12U320_HIST_BUCKETS - 1)]++;
+}
+
+static int gm12u320_submit_urb(struct gm12u320_device *gm12u320,
+			       struct urb *urb)
+{
+	int ret;
+
+	usb_anchor_urb(urb, &gm12u320->pipeline.anchor);
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret)
+		usb_unanchor_urb(urb);
+
+	return ret;
+}
+
+static int gm12u320_xfer_submit(struct gm12u320_device *gm12u320,
+				struct gm12u320_xfer *xfer)
+{
+	int i, ret;
+
+	xfer->last = ktime_get();
+	ret = gm12u320_submit_urb(gm12u320, xfer->cmd);
+	if (ret)
+		return ret;
+
+	if (xfer->flush)
+		flush_kernel_vmap_range(xfer->flush,
+					gm12u320_block_size(xfer->block));
+
+	for (i = 0; i < xfer->data_urbs; i++) {
+		ret = gm12u320_submit_urb(gm12u320, xfer->data[i]);
+		if (ret)
+			return ret;
+	}
+
+	return gm12u320_submit_urb(gm12u320, xfer->status);
+}
+
+/* Must be called with pipeline.lock held */
+static void gm12u320_pipeline_fill(struct gm12u320_device *gm12u320)
+{
+	int ret;
+
+	while (!gm12u320->pipeline.error &&
+	       gm12u320->pipeline.submitted < gm12u320->pipeline.count &&
+	       gm12u320->pipeline.submitted < gm12u320->pipeline.ready &&
+	       gm12u320->pipeline.submitted - gm12u320->pipeline.completed <
+			gm12u320->pipeline.depth) {
+		ret = gm12u320_xfer_submit(gm12u320, &gm12u320->pipeline.xfer[
+			gm12u320->pipeline.order[gm12u320->pipeline.submitted]]);
+		if (ret) {
+			gm12u320->pipeline.error = ret;
+			complete(&gm12u320->pipeline.done);
+			return;
+		}
+		gm12u320->pipeline.submitted++;
+	}
+}
+
+static void gm12u320_pipeline_fail(struct gm12u320_device *gm12u320, int err)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gm12u320->pipeline.lock, flags);
+	if (!gm12u320->pipeline.error) {
+		gm12u320->pipeline.error = err;
+		complete(&gm12u320->pipeline.done);
+	}
+	spin_unlock_irqrestore(&gm12u320->pipeline.lock, flags);
+}
+
+static void gm12u320_trace_xfer(struct gm12u320_xfer *xfer,
+				struct urb *urb, int stage)
+{
+	ktime_t now;
+
+	if (!trace_gm12u320_xfer_enabled())
+		return;
+
+	now = ktime_get();
+	trace_gm12u320_xfer(xfer->block, stage, urb->status,
+			    ktime_to_ns(ktime_sub(now, xfer->last)));
+	xfer->last = now;
+}
+
+static void gm12u320_xfer_out_complete(struct urb *urb)
+{
+	struct gm12u320_xfer *xfer = urb->context;
+	struct gm12u320_device *gm12u320 = xfer->gm12u320;
+
+	gm12u320_trace_xfer(xfer, urb, urb == xfer->cmd ?
+			    GM12U320_XFER_CMD : GM12U320_XFER_DATA);
+
+	if (urb->status)
+		gm12u320_pipeline_fail(gm12u320, urb->status);
+	else if (urb->actual_length != urb->transfer_buffer_length)
+		gm12u320_pipeline_fail(gm12u320, -EIO);
+}
+
+static void gm12u320_xfer_status_complete(struct urb *urb)
+{
+	struct gm12u320_xfer *xfer = urb->context;
+	struct gm12u320_device *gm12u320 = xfer->gm12u320;
+	struct drm_pending_vblank_event *event = NULL;
+	unsigned long flags;
+
+	gm12u320_trace_xfer(xfer, urb, GM12U320_XFER_STATUS);
+
+	if (urb->status) {
+		gm12u320_pipeline_fail(gm12u320, urb->status);
+		return;
+	}
+	if (urb->actual_length != READ_STATUS_SIZE) {
+		gm12u320_pipeline_fail(gm12u320, -EIO);
+		return;
+	}
+
+	spin_lock_irqsave(&gm12u320->pipeline.lock, flags);
+	if (((u8 *)urb->transfer_buffer)[READ_STATUS_RESULT])
+		gm12u320->pipeline.status_error = true;
+	gm12u320->pipeline.completed++;
+	if (gm12u320->pipeline.completed == gm12u320->pipeline.count) {
+		gm12u320->pipeline.end = ktime_get();
+		trace_gm12u320_draw(gm12u320->pipeline.count - 1,
+				    ktime_to_ns(ktime_sub(gm12u320->pipeline.end,
+						gm12u320->pipeline.start)));
+		event = gm12u320->pipeline.event;
+		gm12u320->pipeline.event = NULL;
+		complete(&gm12u320->pipeline.done);
+	} else {
+		gm12u320_pipeline_fill(gm12u320);
+	}
+	spin_unlock_irqrestore(&gm12u320->pipeline.lock, flags);
+
+	if (event)
+		gm12u320_deliver_vblank_event(gm12u320, event);
+}
+
+/*
+ * Start sending the data blocks of a set which are set in the blocks mask,
+ * followed by the draw command. Rather then doing a blocking command / data
+ * / status round trip per block, the transfers for up to xfer_depth blocks
+ * are kept queued, so that the bus does not sit idle while we wait for the
+ * status of the previous block. Only the first ready transfers get submitted,
+ * the rest is submitted after gm12u320_release_blocks() makes them ready.
+ * Any submission errors are reported by gm12u320_wait_frame().
+ */
+static void gm12u320_start_frame(struct gm12u320_device *gm12u320, int set,
+				 int frame, u32 blocks, int ready)
+{
+	struct gm12u320_xfer *xfer;
+	unsigned long flags;
+	int i, block, count = 0;
+	u64 bytes = 0;
+	u8 *cmd;
+
+	for (block = 0; block < GM12U320_BLOCK_COUNT; block++) {
+		if (!(blocks & BIT(block)))
+			continue;
+
+		xfer = &gm12u320->pipeline.xfer[block];
+		xfer->flush = NULL;
+		if (gm12u320->sg.fb[set]) {
+			/* Zero-copy implies host sg support, so 1 data urb */
+			xfer->data[0]->sg = gm12u320->sg.sgl[set][block];
+			xfer->data[0]->num_sgs = gm12u320->sg.nents[set][block];
+		} else if (gm12u320->buf.sg) {
+			xfer->data[0]->sg = gm12u320->buf.sgl[set][block];
+			xfer->data[0]->num_sgs =
+				gm12u320->buf.nents[set][block];
+			xfer->flush = gm12u320->data_buf[set][block];
+		} else {
+			for (i = 0; i < xfer->data_urbs; i++)
+				xfer->data[i]->transfer_buffer = page_address(
+					gm12u320->buf.pages[set][block][i]);
+			xfer->flush = gm12u320->data_buf[set][block];
+		}
+		cmd = xfer->cmd->transfer_buffer;
+		cmd[21] = block | (frame << 7);
+		gm12u320->pipeline.order[count++] = block;
+		bytes += gm12u320_block_size(block);
+	}
+	gm12u320->pipeline.order[count++] = GM12U320_BLOCK_COUNT;
+	bytes += count * (CMD_SIZE + READ_STATUS_SIZE);
+
+	trace_gm12u320_frame_start(set, frame, blocks);
+	reinit_completion(&gm12u320->pipeline.done);
+
+	spin_lock_irqsave(&gm12u320->pipeline.lock, flags);
+	gm12u320->pipeline.count = count;
+	gm12u320->pipeline.ready = ready;
+	gm12u320->pipeline.depth = clamp_t(int, xfer_depth, 1,
+					   GM12U320_BLOCK_COUNT);
+	gm12u320->pipeline.submitted = 0;
+	gm12u320->pipeline.completed = 0;
+	gm12u320->pipeline.error = 0;
+	gm12u320->pipeline.status_error = false;
+	gm12u320->pipeline.bytes = bytes;
+	gm12u320->pipeline.start = ktime_get();
+	gm12u320_pipeline_fill(gm12u320);
+	spin_unlock_irqrestore(&gm12u320->pipeline.lock, flags);
+}
+
+static void gm12u320_release_blocks(struct gm12u320_device *gm12u320,
+				    int ready)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gm12u320->pipeline.lock, flags);
+	gm12u320->pipeline.ready = ready;
+	gm12u320_pipeline_fill(gm12u320);
+	spin_unlock_irqrestore(&gm12u320->pipeline.lock, flags);
+}
+
+/*
+ * Low latency variant of gm12u320_copy_fb_to_blocks() + start_frame(),
+ * which submits each block as soon as it has been converted, rather then
+ * waiting for the conversion of the entire frame.
+ */
+static void gm12u320_stream_frame(struct gm12u320_device *gm12u320, int set,
+				  int frame, u32 blocks,
+				  struct drm_framebuffer *fb,
+				  struct gm12u320_planes *planes,
+				  const struct gm12u320_damage *damage)
+{
+	int block, ready = 0;
+	void *vaddr;
+
+	gm12u320_start_frame(gm12u320, set, frame, blocks, 0);
+
+	vaddr = gm12u320_fb_begin_access(fb);
+	if (vaddr) {
+		gm12u320_plane_begin_access(&planes->overlay);
+		gm12u320_plane_begin_access(&planes->cursor);
+		for (block = 0; block < GM12U320_BLOCK_COUNT; block++) {
+			gm12u320_convert_range(gm12u320, set, fb, vaddr,
+					       planes, damage, block, block);
+			if (blocks & BIT(block))
+				gm12u320_release_blocks(gm12u320, ++ready);
+		}
+		gm12u320_plane_end_access(&planes->cursor);
+		gm12u320_plane_end_access(&planes->overlay);
+		gm12u320_fb_end_access(fb, vaddr);
+	}
+
+	gm12u320_release_blocks(gm12u320, INT_MAX);
+}
+
+static int gm12u320_wait_frame(struct gm12u320_device *gm12u320,
+			       unsigned long timeout)
+{
+	s64 xfer_us;
+	int ret;
+
+	if (wait_for_completion_timeout(&gm12u320->pipeline.done, timeout))
+		ret = gm12u320->pipeline.error;
+	else
+		ret = -ETIMEDOUT;
+
+	/* Make sure all completion handlers have run before re-using urbs */
+	if (!ret && !usb_wait_anchor_empty_timeout(&gm12u320->pipeline.anchor,
+					jiffies_to_msecs(CMD_TIMEOUT)))
+		ret = -ETIMEDOUT;
+
+	if (ret) {
+		usb_kill_anchored_urbs(&gm12u320->pipeline.anchor);
+		gm12u320->stats.last_error = ret;
+		if (gm12u320->pipeline.event) {
+			gm12u320_send_vblank_event(gm12u320,
+						   gm12u320->pipeline.event);
+			gm12u320->pipeline.event = NULL;
+		}
+		return ret;
+	}
+
+	xfer_us = ktime_us_delta(gm12u320->pipeline.end,
+				 gm12u320->pipeline.start);
+	DRM_DEBUG_DRIVER("Frame sent in %lld us (%d blocks in flight)\n",
+			 xfer_us, gm12u320->pipeline.depth);
+
+	gm12u320_hist_add(gm12u320->stats.xfer_us, xfer_us);
+	if (gm12u320->pipeline.count == GM12U320_BLOCK_COUNT + 1)
+		WRITE_ONCE(gm12u320->vblank.period_ns,
+			   max_t(u32, VBLANK_MIN_PERIOD_NS,
+				 (7ULL * gm12u320->vblank.period_ns +
+				  xfer_us * NSEC_PER_USEC) / 8));
+	gm12u320->stats.frames++;
+	gm12u320->stats.bytes += gm12u320->pipeline.bytes;
+	gm12u320->stats.last_draw = gm12u320->pipeline.end;
+	return 0;
+}
+
+/*
+ * In partial frame mode only the changed blocks get send, with the frame
+ * bit always set to the index of the block set being send. So each of the
+ * 2 frame buffers in the device mirrors one of our block sets, the back set
+ * gets converted with the damage of both the new and the previous frame,
+ * so sending the blocks touched by that damage brings the device's copy
+ * fully up to date. The first frame send to each of the device's buffers
+ * must be a full frame.
+ *
+ * An idle keepalive re-uses the frame bit of the previous frame, so that
+ * sending just the draw command, or a single block, redraws the contents
+ * the device already has.
+ */
+static void gm12u320_fb_update_work(struct work_struct *work)
+{
+	struct gm12u320_device *gm12u320 =
+		container_of(work, struct gm12u320_device, fb_update.work);
+	int draw_status_timeout = FIRST_FRAME_TIMEOUT;
+	struct gm12u320_damage damage, front_damage = {}, copy_damage;
+	struct drm_pending_vblank_event *event = NULL;
+	struct gm12u320_planes planes;
+	struct drm_framebuffer *fb;
+	bool in_flight = false;
+	bool full_resend = true;
+	bool idle = false;
+	bool valid[2] = {};
+	bool stream, partial, light_keepalive, zero_copy = false;
+	bool sent_partial = false, sent_keepalive = false;
+	int front = 0;
+	int frame = 1;
+	int ret = 0;
+	ktime_t start;
+	u32 blocks;
+
+	while (gm12u320->fb_update.run) {
+		stream = low_latency;
+		partial = partial_frames && !gm12u320->partial_rejected;
+
+		/*
+		 * Convert the new frame into the back set while the front
+		 * set is (possibly) still being sent. The back set also
+		 * lacks the damage of the frame which is in the front set.
+		 * In low latency mode the conversion is done block by block
+		 * after the front set has been sent. RGB888 fbs may not need
+		 * converting at all, the blocks can point into the fb.
+		 */
+		fb = gm12u320_fb_update_take(gm12u320, &damage, &event,
+					     &planes);
+		if (fb && damage_hash) {
+			gm12u320_damage_refine(gm12u320, fb, &planes, &damage);
+			if (!damage.count) {
+				gm12u320->stats.hash_frames_skipped++;
+				drm_framebuffer_put(fb);
+				gm12u320_planes_put(&planes);
+				fb = NULL;
+			}
+		} else if (fb) {
+			gm12u320_hash_invalidate(gm12u320);
+		}
+		if (fb) {
+			copy_damage = damage;
+			gm12u320_damage_merge(&copy_damage, &front_damage);
+			if (planes.overlay.fb || planes.cursor.fb ||
+			    planes.rotation || planes.color) {
+				gm12u320_sg_put_fb(gm12u320, !front);
+				zero_copy = false;
+			} else {
+				zero_copy = gm12u320_sg_set_fb(gm12u320,
+							       !front, fb);
+			}
+			if (!zero_copy && gm12u320->sg.stale[!front]) {
+				copy_damage.rects[0] = (struct drm_rect) {
+					0, 0, GM12U320_USER_WIDTH,
+					GM12U320_HEIGHT };
+				copy_damage.count = 1;
+				gm12u320->sg.stale[!front] = false;
+			}
+			if (!zero_copy && !stream) {
+				trace_gm12u320_convert_start(!front,
+							     copy_damage.count);
+				start = ktime_get();
+				gm12u320_copy_fb_to_blocks(gm12u320, !front,
+							   fb, &planes,
+							   &copy_damage);
+				gm12u320_hist_add(gm12u320->stats.convert_us,
+					ktime_us_delta(ktime_get(), start));
+				trace_gm12u320_convert_end(!front,
+							   copy_damage.count);
+			}
+		}
+
+		if (in_flight) {
+			in_flight = false;
+			ret = gm12u320_wait_frame(gm12u320,
+					DATA_TIMEOUT + draw_status_timeout);
+			if (sent_partial &&
+			    (ret == -ETIMEDOUT || ret == -EPIPE ||
+			     gm12u320->pipeline.status_error)) {
+				dev_info(&gm12u320->udev->dev,
+					 "Partial frames rejected, sending full frames\n");
+				gm12u320->partial_rejected = true;
+				partial = false;
+				valid[0] = valid[1] = false;
+				full_resend = true;
+				ret = 0;
+			}
+			if (sent_keepalive &&
+			    (ret == -ETIMEDOUT || ret == -EPIPE ||
+			     gm12u320->pipeline.status_error)) {
+				dev_info(&gm12u320->udev->dev,
+					 "Keepalive rejected, sending full frames\n");
+				gm12u320->keepalive_rejected = true;
+				full_resend = true;
+				ret = 0;
+			}
+			if (ret) {
+				if (fb)
+					drm_framebuffer_put(fb);
+				gm12u320_planes_put(&planes);
+				goto err;
+			}
+
+			/* Only count the keepalives the device accepted */
+			if (sent_keepalive && !gm12u320->keepalive_rejected)
+				gm12u320->stats.full_frames_avoided++;
+
+			draw_status_timeout = CMD_TIMEOUT;
+		}
+
+		/* Nothing is in flight, so this is safe without the lock */
+		if (event && !fb) {
+			/*
+			 * The frame was unchanged, there is nothing to draw.
+			 * Its event completes on the next vblank of the timer.
+			 */
+			gm12u320_arm_vblank_event(gm12u320, event);
+			event = NULL;
+		}
+		gm12u320->pipeline.event = event;
+		event = NULL;
+
+		if (fb) {
+			front = !front;
+			front_damage = damage;
+		}
+
+		light_keepalive = !fb && !full_resend && idle &&
+				  keepalive != KEEPALIVE_FULL_FRAME &&
+				  !gm12u320->keepalive_rejected &&
+				  (!partial || valid[front]);
+
+		if (light_keepalive) {
+			/* Re-use the frame bit of the previous frame */
+			blocks = (keepalive == KEEPALIVE_SINGLE_BLOCK) ?
+				 BIT(0) : 0;
+			gm12u320_start_frame(gm12u320, front, frame, blocks,
+					     INT_MAX);
+		} else if (fb || full_resend || idle) {
+			blocks = GM12U320_ALL_BLOCKS;
+			if (fb && partial && valid[front])
+				blocks = gm12u320_damage_blocks(&copy_damage);
+
+			if (partial) {
+				frame = front;
+				valid[front] = true;
+			} else {
+				frame = !frame;
+				valid[0] = valid[1] = false;
+			}
+
+			if (fb && zero_copy)
+				gm12u320->stats.zero_copy_frames++;
+
+			if (fb && stream && !zero_copy) {
+				trace_gm12u320_convert_start(front,
+							     copy_damage.count);
+				start = ktime_get();
+				gm12u320_stream_frame(gm12u320, front, frame,
+						      blocks, fb, &planes,
+						      &copy_damage);
+				gm12u320_hist_add(gm12u320->stats.convert_us,
+					ktime_us_delta(ktime_get(), start));
+				trace_gm12u320_convert_end(front,
+							   copy_damage.count);
+			} else {
+				gm12u320_start_frame(gm12u320, front, frame,
+						     blocks, INT_MAX);
+			}
+		}
+
+		if (fb || full_resend || idle) {
+			if (!fb)
+				gm12u320->stats.keepalive_frames++;
+			sent_keepalive = light_keepalive;
+			sent_partial = !light_keepalive &&
+				       blocks != GM12U320_ALL_BLOCKS;
+			full_resend = false;
+			in_flight = true;
+		}
+
+		if (fb)
+			drm_framebuffer_put(fb);
+		gm12u320_planes_put(&planes);
+
+		/*
+		 * We must draw a frame every 2s otherwise the projector
+		 * switches back to showing its logo.
+		 */
+		idle = !wait_event_timeout(gm12u320->fb_update.waitq,
+					   gm12u320_fb_update_ready(gm12u320),
+					   IDLE_TIMEOUT);
+		trace_gm12u320_wakeup(idle);
+	}
+
+	if (in_flight)
+		ret = gm12u320_wait_frame(gm12u320,
+					  DATA_TIMEOUT + draw_status_timeout);
+err:
+	gm12u320_hash_invalidate(gm12u320);
+
+	/* Do not log errors caused by module unload or device unplug */
+	if (ret && gm12u320->fb_update.run &&
+	    ret != -ECONNRESET && ret != -ESHUTDOWN)
+		dev_err(&gm12u320->udev->dev, "Frame update error: %d\n", ret);
+
+	/*
+	 * Userspace must always get its flip events, also those of later
+	 * commits, which nothing draws anymore.
+	 */
+	if (event)
+		gm12u320_send_vblank_event(gm12u320, event);
+
+	mutex_lock(&gm12u320->fb_update.lock);
+	event = gm12u320_pending_kill(&gm12u320->fb_update.pending);
+	mutex_unlock(&gm12u320->fb_update.lock);
+
+	if (event)
+		gm12u320_send_vblank_event(gm12u320, event);
+}
+
+/*
+ * If event is not NULL, it gets send once the frame has been drawn. The
+ * caller must hold a vblank reference for it. If fence is not NULL, the
+ * planes do not get read until it and the pending fences of the other planes
+ * signal, it replaces the pending fence of slot. This takes over the fence
+ * reference.
+ */
+static void gm12u320_fb_mark_dirty(struct drm_framebuffer *fb,
+				   const struct gm12u320_damage *damage,
+				   struct drm_pending_vblank_event *event,
+				   int slot, struct dma_fence *fence)
+{
+	struct gm12u320_device *gm12u320 = fb->dev->dev_private;
+	struct drm_pending_vblank_event *old_event;
+	struct drm_framebuffer *old_fb;
+	bool wakeup = false;
+	int i;
+
+	for (i = 0; i < damage->count; i++)
+		trace_gm12u320_mark_dirty(&damage->rects[i]);
+
+	mutex_lock(&gm12u320->fb_update.lock);
+
+	if (gm12u320->fb_update.pending.fb)
+		gm12u320->stats.frames_coalesced++;
+
+	/*
+	 * Without a new fence, the old one still applies to the same fb. A
+	 * new primary fb without a (pending) fence no longer needs to wait
+	 * for the rendering to the old one.
+	 */
+	if (fence && dma_fence_is_signaled(fence)) {
+		dma_fence_put(fence);
+		fence = NULL;
+	}
+	if (fence || (slot == GM12U320_FENCE_PRIMARY &&
+		      gm12u320->fb_update.pending.fb != fb))
+		gm12u320_fb_update_set_fence(gm12u320, slot, fence);
+
+	if (gm12u320_pending_mark(&gm12u320->fb_update.pending, fb, damage,
+				  event, &old_fb, &old_event)) {
+		drm_framebuffer_get(fb);
+		wakeup = true;
+	}
+
+	mutex_unlock(&gm12u320->fb_update.lock);
+
+	if (old_event)
+		gm12u320_send_vblank_event(gm12u320, old_event);
+
+	if (wakeup)
+		wake_up(&gm12u320->fb_update.waitq);
+
+	if (old_fb)
+		drm_framebuffer_put(old_fb);
+}
+
+static void gm12u320_start_fb_update(struct gm12u320_device *gm12u320)
+{
+	mutex_lock(&gm12u320->fb_update.lock);
+	gm12u320->fb_update.run = true;
+	gm12u320->fb_update.pending.dead = false;
+	mutex_unlock(&gm12u320->fb_update.lock);
+
+	queue_work(gm12u320->fb_update.workq, &gm12u320->fb_update.work);
+}
+
+static void gm12u320_stop_fb_update(struct gm12u320_device *gm12u320)
+{
+	mutex_lock(&gm12u320->fb_update.lock);
+	gm12u320->fb_update.run = false;
+	mutex_unlock(&gm12u320->fb_update.lock);
+
+	wake_up(&gm12u320->fb_update.waitq);
+	/* Abort any in flight transfers and refuse new ones */
+	usb_poison_anchored_urbs(&gm12u320->pipeline.anchor);
+	cancel_work_sync(&gm12u320->fb_update.work);
+	usb_unpoison_anchored_urbs(&gm12u320->pipeline.anchor);
+
+	mutex_lock(&gm12u320->fb_update.lock);
+	if (gm12u320->fb_update.pending.fb) {
+		drm_framebuffer_put(gm12u320->fb_update.pending.fb);
+		gm12u320->fb_update.pending.fb = NULL;
+	}
+	if (gm12u320->fb_update.pending.event) {
+		gm12u320_send_vblank_event(gm12u320,
+					   gm12u320->fb_update.pending.event);
+		gm12u320->fb_update.pending.event = NULL;
+	}
+	gm12u320_fb_update_clear_fences(gm12u320);
+	mutex_unlock(&gm12u320->fb_update.lock);
+}
+
+static int gm12u320_set_ecomode(struct gm12u320_device *gm12u320)
+{
+	return gm12u320_misc_request(gm12u320, MISC_REQ_GET_SET_ECO_A,
+				     MISC_REQ_GET_SET_ECO_B, 0x01 /* set */,
+				     eco_mode ? 0x01 : 0x00, 0x00, 0x01);
+}
+
+/* ------------------------------------------------------------------ */
+/* gm12u320 connector						      */
+
+/*
+ * We use fake EDID info so that userspace know that it is dealing with
+ * an Acer projector, rather then listing this as an "unknown" monitor.
+ * Note this assumes this driver is only ever used with the Acer C120, if we
+ * add support for other devices the vendor and model should be parameterized.
+ */
+static struct edid gm12u320_edid = {
+	.header		= { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 },
+	.mfg_id		= { 0x04, 0x72 },	/* "ACR" */
+	.prod_code	= { 0x20, 0xc1 },	/* C120h */
+	.serial		= 0xaa55aa55,
+	.mfg_week	= 1,
+	.mfg_year	= 16,
+	.version	= 1,			/* EDID 1.3 */
+	.revision	= 3,			/* EDID 1.3 */
+	.input		= 0x08,			/* Analog input */
+	.features	= 0x0a,			/* Pref timing in DTD 1 */
+	.standard_timings = { { 1, 1 }, { 1, 1 }, { 1, 1 }, { 1, 1 },
+			      { 1, 1 }, { 1, 1 }, { 1, 1 }, { 1, 1 } },
+	.detailed_timings = { {
+		.pixel_clock = 3383,
+		/* hactive = 848, hblank = 256 */
+		.data.pixel_data.hactive_lo = 0x50,
+		.data.pixel_data.hblank_lo = 0x00,
+		.data.pixel_data.hactive_hblank_hi = 0x31,
+		/* vactive = 480, vblank = 28 */
+		.data.pixel_data.vactive_lo = 0xe0,
+		.data.pixel_data.vblank_lo = 0x1c,
+		.data.pixel_data.vactive_vblank_hi = 0x10,
+		/* hsync offset 40 pw 128, vsync offset 1 pw 4 */
+		.data.pixel_data.hsync_offset_lo = 0x28,
+		.data.pixel_data.hsync_pulse_width_lo = 0x80,
+		.data.pixel_data.vsync_offset_pulse_width_lo = 0x14,
+		.data.pixel_data.hsync_vsync_offset_pulse_width_hi = 0x00,
+		/* Digital separate syncs, hsync+, vsync+ */
+		.data.pixel_data.misc = 0x1e,
+	}, {
+		.pixel_clock = 0,
+		.data.other_data.type = 0xfd, /* Monitor ranges */
+		.data.other_data.data.range.min_vfreq = 59,
+		.data.other_data.data.range.max_vfreq = 61,
+		.data.other_data.data.range.min_hfreq_khz = 29,
+		.data.other_data.data.range.max_hfreq_khz = 32,
+		.data.other_data.data.range.pixel_clock_mhz = 4, /* 40 MHz */
+		.data.other_data.data.range.flags = 0,
+		.data.other_data.data.range.formula.cvt = {
+			0xa0, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20 },
+	}, {
+		.pixel_clock = 0,
+		.data.other_data.type = 0xfc, /* Model string */
+		.data.other_data.data.str.str = {
+			'P', 'r', 'o', 'j', 'e', 'c', 't', 'o', 'r', '\n',
+			' ', ' ',  ' ' },
+	}, {
+		.pixel_clock = 0,
+		.data.other_data.type = 0xfe, /* Unspecified text / padding */
+		.data.other_data.data.str.str = {
+			'\n', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+			' ', ' ',  ' ' },
+	} },
+	.checksum = 0x13,
+};
+
+static int gm12u320_conn_get_modes(struct drm_connector *connector)
+{
+	drm_connector_update_edid_property(connector, &gm12u320_edid);
+	return drm_add_edid_modes(connector, &gm12u320_edid);
+}
+
+static const struct drm_connector_helper_funcs gm12u320_conn_helper_funcs = {
+	.get_modes = gm12u320_conn_get_modes,
+};
+
+static const struct drm_connector_funcs gm12u320_conn_funcs = {
+	.fill_modes = drm_helper_probe_single_connector_modes,
+	.destroy = drm_connector_cleanup,
+	.reset = drm_atomic_helper_connector_reset,
+	.atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
+};
+
+static int gm12u320_conn_init(struct gm12u320_device *gm12u320)
+{
+	drm_connector_helper_add(&gm12u320->conn, &gm12u320_conn_helper_funcs);
+	return drm_connector_init(&gm12u320->dev, &gm12u320->conn,
+				  &gm12u320_conn_funcs, DRM_MODE_CONNECTOR_VGA);
+}
+
+/* ------------------------------------------------------------------ */
+/* gm12u320 (simple) display pipe				      */
+
+/*
+ * Rotating by 180 degrees is the same as reflecting in both directions, so
+ * reflections are all the conversion needs to handle. Returns true if the
+ * rotation changed.
+ */
+static bool gm12u320_set_rotation(struct gm12u320_device *gm12u320,
+				  unsigned int rotation)
+{
+	bool changed;
+
+	rotation = drm_rotation_simplify(rotation, DRM_MODE_ROTATE_0 |
+					 DRM_MODE_REFLECT_MASK);
+	rotation &= DRM_MODE_REFLECT_MASK;
+
+	mutex_lock(&gm12u320->fb_update.lock);
+	changed = gm12u320->fb_update.planes.rotation != rotation;
+	gm12u320->fb_update.planes.rotation = rotation;
+	mutex_unlock(&gm12u320->fb_update.lock);
+
+	return changed;
+}
+
+static void gm12u320_set_color(struct gm12u320_device *gm12u320,
+			       const struct drm_crtc_state *state)
+{
+	struct gm12u320_color *color, *old_color;
+
+	color = gm12u320_color_create(state);
+	if (IS_ERR(color)) {
+		DRM_ERROR("Failed to allocate color correction tables\n");
+		return;
+	}
+
+	mutex_lock(&gm12u320->fb_update.lock);
+	old_color = gm12u320->fb_update.planes.color;
+	gm12u320->fb_update.planes.color = color;
+	mutex_unlock(&gm12u320->fb_update.lock);
+
+	gm12u320_color_put(old_color);
+}
+
+static void gm12u320_pipe_enable(struct drm_simple_display_pipe *pipe,
+				 struct drm_crtc_state *crtc_state,
+				 struct drm_plane_state *plane_state)
+{
+	struct gm12u320_device *gm12u320 = pipe->crtc.dev->dev_private;
+	struct gm12u320_damage damage = {
+		.rects = { { 0, 0, GM12U320_USER_WIDTH, GM12U320_HEIGHT } },
+		.count = 1,
+	};
+
+	drm_crtc_vblank_on(&pipe->crtc);
+	gm12u320_set_rotation(gm12u320, plane_state->rotation);
+	gm12u320_fb_mark_dirty(plane_state->fb, &damage, NULL,
+			       GM12U320_FENCE_PRIMARY, NULL);
+	gm12u320_start_fb_update(gm12u320);
+	gm12u320->pipe_enabled = true;
+}
+
+static void gm12u320_pipe_disable(struct drm_simple_display_pipe *pipe)
+{
+	struct gm12u320_device *gm12u320 = pipe->crtc.dev->dev_private;
+
+	gm12u320_stop_fb_update(gm12u320);
+	gm12u320_sg_put_fb(gm12u320, 0);
+	gm12u320_sg_put_fb(gm12u320, 1);
+	drm_crtc_vblank_off(&pipe->crtc);
+	gm12u320->pipe_enabled = false;
+}
+
+/*
+ * Take the flip event of the commit, if there is something to draw it is
+ * returned, with a vblank reference held for it, to be passed to
+ * gm12u320_fb_mark_dirty(). Otherwise the flip is done right away.
+ */
+static struct drm_pending_vblank_event *
+gm12u320_crtc_take_event(struct gm12u320_device *gm12u320, bool draw)
+{
+	struct drm_crtc *crtc = &gm12u320->pipe.crtc;
+	struct drm_pending_vblank_event *event = crtc->state->event;
+
+	if (!event)
+		return NULL;
+
+	crtc->state->event = NULL;
+
+	if (draw && gm12u320->pipe_enabled && !drm_crtc_vblank_get(crtc))
+		return event;
+
+	spin_lock_irq(&crtc->dev->event_lock);
+	drm_crtc_send_vblank_event(crtc, event);
+	spin_unlock_irq(&crtc->dev->event_lock);
+	return NULL;
+}
+
+static void gm12u320_pipe_update(struct drm_simple_display_pipe *pipe,
+				 struct drm_plane_state *old_state)
+{
+	struct gm12u320_device *gm12u320 = pipe->crtc.dev->dev_private;
+	struct drm_plane_state *state = pipe->plane.state;
+	struct drm_pending_vblank_event *event;
+	struct drm_atomic_helper_damage_iter iter;
+	struct gm12u320_damage damage = {};
+	struct drm_rect clip;
+	bool full;
+
+	full = gm12u320_set_rotation(gm12u320, state->rotation);
+
+	/*
+	 * Only the affected planes get updated on a CRTC property change,
+	 * which is the primary plane, see drm_simple_kms_crtc_check().
+	 */
+	if (pipe->crtc.state->color_mgmt_changed) {
+		gm12u320_set_color(gm12u320, pipe->crtc.state);
+		full = true;
+	}
+
+	/*
+	 * simple-kms also calls this when the plane gets disabled, the new
+	 * rotation and color state then apply to the next fb.
+	 */
+	if (!state->fb || !state->visible) {
+		gm12u320_crtc_take_event(gm12u320, false);
+		return;
+	}
+
+	/* The damage clips are in fb coordinates, turn them into screen ones */
+	if (full) {
+		clip = (struct drm_rect) {
+			0, 0, GM12U320_USER_WIDTH, GM12U320_HEIGHT };
+		gm12u320_damage_add(&damage, &clip);
+	} else {
+		drm_atomic_helper_damage_iter_init(&iter, old_state, state);
+		drm_atomic_for_each_plane_damage(&iter, &clip) {
+			drm_rect_rotate(&clip, GM12U320_USER_WIDTH,
+					GM12U320_HEIGHT, state->rotation);
+			gm12u320_damage_add(&damage, &clip);
+		}
+	}
+
+	event = gm12u320_crtc_take_event(gm12u320, damage.count);
+
+	/*
+	 * Rather then blocking the commit on the rendering to the fb, the
+	 * worker waits for its exclusive fence before reading the fb.
+	 */
+	if (damage.count)
+		gm12u320_fb_mark_dirty(state->fb, &damage, event,
+			GM12U320_FENCE_PRIMARY,
+			reservation_object_get_excl_rcu(state->fb->obj[0]->resv));
+}
+
+static int gm12u320_pipe_enable_vblank(struct drm_simple_display_pipe *pipe)
+{
+	struct gm12u320_device *gm12u320 = pipe->crtc.dev->dev_private;
+
+	WRITE_ONCE(gm12u320->vblank.enabled, true);
+	hrtimer_start(&gm12u320->vblank.timer,
+		      ns_to_ktime(READ_ONCE(gm12u320->vblank.period_ns)),
+		      HRTIMER_MODE_REL);
+	return 0;
+}
+
+/*
+ * This gets called with the vblank time lock held, which the timer also
+ * takes, so we cannot wait for a running timer, it stops itself instead.
+ */
+static void gm12u320_pipe_disable_vblank(struct drm_simple_display_pipe *pipe)
+{
+	struct gm12u320_device *gm12u320 = pipe->crtc.dev->dev_private;
+
+	WRITE_ONCE(gm12u320->vblank.enabled, false);
+	hrtimer_try_to_cancel(&gm12u320->vblank.timer);
+}
+
+/* Set up the vmap of the fb, which it keeps until it gets destroyed */
+static int gm12u320_plane_prepare_fb(struct drm_plane *plane,
+				     struct drm_plane_state *plane_state)
+{
+	struct drm_framebuffer *fb = plane_state->fb;
+	void *vaddr;
+
+	if (!fb || READ_ONCE(to_gm12u320_fb(fb)->vaddr))
+		return 0;
+
+	vaddr = drm_gem_shmem_vmap(fb->obj[0]);
+	if (IS_ERR(vaddr))
+		return PTR_ERR(vaddr);
+
+	/* Commits on other planes may be putting the same fb up */
+	if (cmpxchg(&to_gm12u320_fb(fb)->vaddr, NULL, vaddr))
+		drm_gem_shmem_vunmap(fb->obj[0], vaddr);
+
+	return 0;
+}
+
+static int gm12u320_pipe_prepare_fb(struct drm_simple_display_pipe *pipe,
+				    struct drm_plane_state *plane_state)
+{
+	return gm12u320_plane_prepare_fb(&pipe->plane, plane_state);
+}
+
+static const struct drm_simple_display_pipe_funcs gm12u320_pipe_funcs = {
+	.enable	    = gm12u320_pipe_enable,
+	.disable    = gm12u320_pipe_disable,
+	.update	    = gm12u320_pipe_update,
+	.prepare_fb = gm12u320_pipe_prepare_fb,
+	.enable_vblank = gm12u320_pipe_enable_vblank,
+	.disable_vblank = gm12u320_pipe_disable_vblank,
+};
+
+static const uint32_t gm12u320_pipe_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_RGB888,
+	DRM_FORMAT_RGB565,
+};
+
+static const uint64_t gm12u320_pipe_modifiers[] = {
+	DRM_FORMAT_MOD_LINEAR,
+	DRM_FORMAT_MOD_INVALID
+};
+
+/* ------------------------------------------------------------------ */
+/* gm12u320 overlay and cursor planes				      */
+
+/*
+ * The overlay is an unscaled, opaque YCbCr plane for video playback, it gets
+ * converted straight into the data blocks, instead of the primary fb pixels
+ * below it. The cursor is blended over the result of that.
+ */
+static int gm12u320_plane_atomic_check(struct drm_plane *plane,
+				       struct drm_plane_state *state)
+{
+	struct drm_crtc_state *crtc_state;
+	int ret;
+
+	if (!state->crtc)
+		return 0;
+
+	if (plane->type == DRM_PLANE_TYPE_CURSOR &&
+	    (state->fb->width > GM12U320_CURSOR_SIZE ||
+	     state->fb->height > GM12U320_CURSOR_SIZE))
+		return -EINVAL;
+
+	crtc_state = drm_atomic_get_new_crtc_state(state->state, state->crtc);
+	ret = drm_atomic_helper_check_plane_state(state, crtc_state,
+						  DRM_PLANE_HELPER_NO_SCALING,
+						  DRM_PLANE_HELPER_NO_SCALING,
+						  true, true);
+	if (ret)
+		return ret;
+
+	/* We only vmap the first object */
+	if (state->fb && state->fb->format->num_planes > 1 &&
+	    state->fb->obj[1] != state->fb->obj[0])
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Only the old and new plane areas get marked dirty, so moving the cursor
+ * around only converts and sends the blocks it touches.
+ */
+static void gm12u320_plane_atomic_update(struct drm_plane *plane,
+					 struct drm_plane_state *old_state)
+{
+	struct gm12u320_device *gm12u320 = plane->dev->dev_private;
+	struct drm_framebuffer *primary = gm12u320->pipe.plane.state->fb;
+	struct drm_plane_state *state = plane->state;
+	struct drm_pending_vblank_event *event;
+	struct gm12u320_damage damage = {};
+	struct drm_framebuffer *old_fb;
+	struct gm12u320_plane *target;
+	struct dma_fence *fence = NULL;
+	int slot;
+
+	if (plane->type == DRM_PLANE_TYPE_CURSOR) {
+		target = &gm12u320->fb_update.planes.cursor;
+		slot = GM12U320_FENCE_CURSOR;
+	} else {
+		target = &gm12u320->fb_update.planes.overlay;
+		slot = GM12U320_FENCE_OVERLAY;
+	}
+
+	if (old_state->visible)
+		gm12u320_damage_add(&damage, &old_state->dst);
+	if (state->visible)
+		gm12u320_damage_add(&damage, &state->dst);
+
+	mutex_lock(&gm12u320->fb_update.lock);
+	old_fb = target->fb;
+	target->fb = NULL;
+	if (state->visible) {
+		drm_framebuffer_get(state->fb);
+		target->fb = state->fb;
+		target->src_x = state->src.x1 >> 16;
+		target->src_y = state->src.y1 >> 16;
+		target->dst = state->dst;
+		if (plane->type == DRM_PLANE_TYPE_OVERLAY)
+			target->coeffs =
+				&gm12u320_yuv_coeffs[state->color_encoding]
+						    [state->color_range];
+	}
+	/* The rendering to the old fb of the plane no longer matters */
+	if (target->fb != old_fb)
+		gm12u320_fb_update_set_fence(gm12u320, slot, NULL);
+	mutex_unlock(&gm12u320->fb_update.lock);
+
+	if (old_fb)
+		drm_framebuffer_put(old_fb);
+
+	if (!primary)
+		damage.count = 0;
+
+	event = gm12u320_crtc_take_event(gm12u320, damage.count);
+	if (!damage.count)
+		return;
+
+	if (state->visible)
+		fence = reservation_object_get_excl_rcu(state->fb->obj[0]->resv);
+
+	gm12u320_fb_mark_dirty(primary, &damage, event, slot, fence);
+}
+
+static const struct drm_plane_helper_funcs gm12u320_plane_helper_funcs = {
+	.prepare_fb = gm12u320_plane_prepare_fb,
+	.atomic_check = gm12u320_plane_atomic_check,
+	.atomic_update = gm12u320_plane_atomic_update,
+};
+
+static const struct drm_plane_funcs gm12u320_plane_funcs = {
+	.update_plane = drm_atomic_helper_update_plane,
+	.disable_plane = drm_atomic_helper_disable_plane,
+	.destroy = drm_plane_cleanup,
+	.reset = drm_atomic_helper_plane_reset,
+	.atomic_duplicate_state = drm_atomic_helper_plane_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_plane_destroy_state,
+};
+
+static const uint32_t gm12u320_overlay_formats[] = {
+	DRM_FORMAT_NV12,
+	DRM_FORMAT_YUYV,
+};
+
+static const uint32_t gm12u320_cursor_formats[] = {
+	DRM_FORMAT_ARGB8888,
+};
+
+static int gm12u320_planes_init(struct gm12u320_device *gm12u320)
+{
+	int ret;
+
+	drm_plane_helper_add(&gm12u320->overlay, &gm12u320_plane_helper_funcs);
+	ret = drm_universal_plane_init(&gm12u320->dev, &gm12u320->overlay,
+				       drm_crtc_mask(&gm12u320->pipe.crtc),
+				       &gm12u320_plane_funcs,
+				       gm12u320_overlay_formats,
+				       ARRAY_SIZE(gm12u320_overlay_formats),
+				       gm12u320_pipe_modifiers,
+				       DRM_PLANE_TYPE_OVERLAY, NULL);
+	if (ret)
+		return ret;
+
+	ret = drm_plane_create_color_properties(&gm12u320->overlay,
+					BIT(DRM_COLOR_YCBCR_BT601) |
+					BIT(DRM_COLOR_YCBCR_BT709),
+					BIT(DRM_COLOR_YCBCR_LIMITED_RANGE) |
+					BIT(DRM_COLOR_YCBCR_FULL_RANGE),
+					DRM_COLOR_YCBCR_BT601,
+					DRM_COLOR_YCBCR_LIMITED_RANGE);
+	if (ret)
+		return ret;
+
+	drm_plane_helper_add(&gm12u320->cursor, &gm12u320_plane_helper_funcs);
+	ret = drm_universal_plane_init(&gm12u320->dev, &gm12u320->cursor,
+				       drm_crtc_mask(&gm12u320->pipe.crtc),
+				       &gm12u320_plane_funcs,
+				       gm12u320_cursor_formats,
+				       ARRAY_SIZE(gm12u320_cursor_formats),
+				       gm12u320_pipe_modifiers,
+				       DRM_PLANE_TYPE_CURSOR, NULL);
+	if (ret)
+		return ret;
+
+	gm12u320->pipe.crtc.cursor = &gm12u320->cursor;
+	gm12u320->dev.mode_config.cursor_width = GM12U320_CURSOR_SIZE;
+	gm12u320->dev.mode_config.cursor_height = GM12U320_CURSOR_SIZE;
+
+	return 0;
+}
+
+#ifdef CONFIG_DEBUG_FS
+static void gm12u320_debugfs_hist(struct seq_file *m, const char *name,
+				  const u32 *hist)
+{
+	int i;
+
+	seq_printf(m, "%s:\n", name);
+	for (i = 0; i < GM12U320_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		seq_printf(m, "  %s%7lu us: %u\n",
+			   i == GM12U320_HIST_BUCKETS - 1 ? ">=" : "< ",
+			   i == GM12U320_HIST_BUCKETS - 1 ? BIT(i - 1) : BIT(i),
+			   hist[i]);
+	}
+}
+
+static int gm12u320_debugfs_stats(struct seq_file *m, void *data)
+{
+	struct drm_info_node *node = m->private;
+	struct gm12u320_device *gm12u320 = node->minor->dev->dev_private;
+
+	seq_printf(m, "frames sent: %llu\n", gm12u320->stats.frames);
+	seq_printf(m, "frames coalesced: %llu\n",
+		   gm12u320->stats.frames_coalesced);
+	seq_printf(m, "keepalive frames: %llu\n",
+		   gm12u320->stats.keepalive_frames);
+	seq_printf(m, "full frames avoided: %llu\n",
+		   gm12u320->stats.full_frames_avoided);
+	seq_printf(m, "zero-copy frames: %llu\n",
+		   gm12u320->stats.zero_copy_frames);
+	seq_printf(m, "parallel conversions: %llu\n",
+		   gm12u320->stats.parallel_converts);
+	seq_printf(m, "damage hash: %llu of %llu rows unchanged, %llu frames skipped\n",
+		   gm12u320->stats.hash_rows_unchanged,
+		   gm12u320->stats.hash_rows,
+		   gm12u320->stats.hash_frames_skipped);
+	seq_printf(m, "bytes sent: %llu\n", gm12u320->stats.bytes);
+	seq_printf(m, "data buffers: %zu bytes in order-0 pages, allocated in %lld us, sent %s\n",
+		   gm12u320->buf.footprint, gm12u320->buf.alloc_us,
+		   gm12u320->buf.sg ? "as sg lists" : "per page");
+	seq_printf(m, "last error: %d\n", gm12u320->stats.last_error);
+	if (gm12u320->stats.last_draw)
+		seq_printf(m, "last draw: %lld ms ago\n",
+			   ktime_ms_delta(ktime_get(),
+					  gm12u320->stats.last_draw));
+	else
+		seq_puts(m, "last draw: never\n");
+	gm12u320_debugfs_hist(m, "conversion time", gm12u320->stats.convert_us);
+	gm12u320_debugfs_hist(m, "transmit time", gm12u320->stats.xfer_us);
+	return 0;
+}
+
+static const struct drm_info_list gm12u320_debugfs_list[] = {
+	{ "stats", gm12u320_debugfs_stats, 0 },
+};
+
+static int gm12u320_debugfs_init(struct drm_minor *minor)
+{
+	return drm_debugfs_create_files(gm12u320_debugfs_list,
+					ARRAY_SIZE(gm12u320_debugfs_list),
+					minor->debugfs_root, minor);
+}
+#endif
+
+static void gm12u320_driver_release(struct drm_device *dev)
+{
+	struct gm12u320_device *gm12u320 = dev->dev_private;
+
+	WRITE_ONCE(gm12u320->vblank.enabled, false);
+	hrtimer_cancel(&gm12u320->vblank.timer);
+	gm12u320_usb_free(gm12u320);
+	drm_mode_config_cleanup(dev);
+	drm_dev_fini(dev);
+	kfree(gm12u320);
+}
+
+DEFINE_DRM_GEM_SHMEM_FOPS(gm12u320_fops);
+
+static struct drm_driver gm12u320_drm_driver = {
+	.driver_features = DRIVER_MODESET | DRIVER_GEM | DRIVER_ATOMIC | DRIVER_PRIME,
+
+	.name		 = DRIVER_NAME,
+	.desc		 = DRIVER_DESC,
+	.date		 = DRIVER_DATE,
+	.major		 = DRIVER_MAJOR,
+	.minor		 = DRIVER_MINOR,
+
+	.release	 = gm12u320_driver_release,
+	.fops		 = &gm12u320_fops,
+#ifdef CONFIG_DEBUG_FS
+	.debugfs_init	 = gm12u320_debugfs_init,
+#endif
+	DRM_GEM_SHMEM_DRIVER_OPS,
+};
+
+static void gm12u320_fb_destroy(struct drm_framebuffer *fb)
+{
+	struct gm12u320_fb *gfb = to_gm12u320_fb(fb);
+
+	if (gfb->vaddr)
+		drm_gem_shmem_vunmap(fb->obj[0], gfb->vaddr);
+
+	/* This frees gfb, fb is its first member */
+	drm_gem_fb_destroy(fb);
+}
+
+static const struct drm_framebuffer_funcs gm12u320_fb_funcs = {
+	.destroy	= gm12u320_fb_destroy,
+	.create_handle	= drm_gem_fb_create_handle,
+	.dirty		= drm_atomic_helper_dirtyfb,
+};
+
+/*
+ * Like drm_gem_fb_create_with_dirty(), but with room for the vmap in the fb.
+ * The GEM objects must be large enough for the fb.
+ */
+static struct drm_framebuffer *
+gm12u320_fb_create(struct drm_device *dev, struct drm_file *file,
+		   const struct drm_mode_fb_cmd2 *mode_cmd)
+{
+	struct drm_gem_object *obj;
+	const struct drm_format_info *info;
+	unsigned int width, height, min_size;
+	struct gm12u320_fb *gfb;
+	int i, ret;
+
+	info = drm_get_format_info(dev, mode_cmd);
+	if (!info)
+		return ERR_PTR(-EINVAL);
+
+	gfb = kzalloc(sizeof(*gfb), GFP_KERNEL);
+	if (!gfb)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < info->num_planes; i++) {
+		width = mode_cmd->width / (i ? info->hsub : 1);
+		height = mode_cmd->height / (i ? info->vsub : 1);
+
+		obj = drm_gem_object_lookup(file, mode_cmd->handles[i]);
+		if (!obj) {
+			ret = -ENOENT;
+			goto err_put;
+		}
+		gfb->base.obj[i] = obj;
+
+		min_size = (height - 1) * mode_cmd->pitches[i] +
+			   drm_format_info_min_pitch(info, i, width) +
+			   mode_cmd->offsets[i];
+		if (obj->size < min_size) {
+			ret = -EINVAL;
+			goto err_put;
+		}
+	}
+
+	drm_helper_mode_fill_fb_struct(dev, &gfb->base, mode_cmd);
+	ret = drm_framebuffer_init(dev, &gfb->base, &gm12u320_fb_funcs);
+	if (ret)
+		goto err_put;
+
+	return &gfb->base;
+
+err_put:
+	for (i = 0; i < info->num_planes; i++) {
+		if (gfb->base.obj[i])
+			drm_gem_object_put_unlocked(gfb->base.obj[i]);
+	}
+	kfree(gfb);
+	return ERR_PTR(ret);
+}
+
+static const struct drm_mode_config_funcs gm12u320_mode_config_funcs = {
+	.fb_create = gm12u320_fb_create,
+	.atomic_check = drm_atomic_helper_check,
+	.atomic_commit = drm_atomic_helper_commit,
+};
+
+/*
+ * The device has bulk endpoints 1 and 2 in and 3 and 4 out. A gadget
+ * emulating it (see tools/) gets whatever endpoint numbers its UDC hands out,
+ * so take the lower resp. higher numbered bulk endpoint of each direction.
+ */
+static void gm12u320_find_endpoints(struct gm12u320_device *gm12u320,
+				    struct usb_interface *interface)
+{
+	struct usb_host_interface *alt = interface->cur_altsetting;
+	struct usb_endpoint_descriptor *desc;
+	unsigned long in = 0, out = 0;
+	int i;
+
+	gm12u320->ep.misc_rcv = MISC_RCV_EPT;
+	gm12u320->ep.data_rcv = DATA_RCV_EPT;
+	gm12u320->ep.data_snd = DATA_SND_EPT;
+	gm12u320->ep.misc_snd = MISC_SND_EPT;
+
+	for (i = 0; i < alt->desc.bNumEndpoints; i++) {
+		desc = &alt->endpoint[i].desc;
+		if (!usb_endpoint_xfer_bulk(desc))
+			continue;
+
+		if (usb_endpoint_dir_in(desc))
+			in |= BIT(usb_endpoint_num(desc));
+		else
+			out |= BIT(usb_endpoint_num(desc));
+	}
+
+	if (hweight_long(in) != 2 || hweight_long(out) != 2) {
+		dev_warn(&interface->dev, "Unexpected endpoints, using the defaults\n");
+		return;
+	}
+
+	gm12u320->ep.misc_rcv = __ffs(in);
+	gm12u320->ep.data_rcv = __fls(in);
+	gm12u320->ep.data_snd = __ffs(out);
+	gm12u320->ep.misc_snd = __fls(out);
+
+	if (gm12u320->ep.misc_rcv != MISC_RCV_EPT ||
+	    gm12u320->ep.data_rcv != DATA_RCV_EPT ||
+	    gm12u320->ep.data_snd != DATA_SND_EPT ||
+	    gm12u320->ep.misc_snd != MISC_SND_EPT)
+		dev_info(&interface->dev,
+			 "Using endpoints %d, %d in and %d, %d out\n",
+			 gm12u320->ep.misc_rcv, gm12u320->ep.data_rcv,
+			 gm12u320->ep.data_snd, gm12u320->ep.misc_snd);
+}
+
+static int gm12u320_usb_probe(struct usb_interface *interface,
+			      const struct usb_device_id *id)
+{
+	struct gm12u320_device *gm12u320;
+	struct drm_device *dev;
+	int i, ret;
+
+	/*
+	 * The gm12u320 presents itself to the system as 2 usb mass-storage
+	 * interfaces, we only care about / need the first one.
+	 */
+	if (interface->cur_altsetting->desc.bInterfaceNumber != 0)
+		return -ENODEV;
+
+	gm12u320 = kzalloc(sizeof(*gm12u320), GFP_KERNEL);
+	if (gm12u320 == NULL)
+		return -ENOMEM;
+
+	gm12u320->udev = interface_to_usbdev(interface);
+	gm12u320_find_endpoints(gm12u320, interface);
+	INIT_WORK(&gm12u320->fb_update.work, gm12u320_fb_update_work);
+	for (i = 0; i < ARRAY_SIZE(gm12u320->fb_update.jobs); i++) {
+		gm12u320->fb_update.jobs[i].gm12u320 = gm12u320;
+		INIT_WORK(&gm12u320->fb_update.jobs[i].work,
+			  gm12u320_convert_job_work);
+	}
+	for (i = 0; i < GM12U320_FENCE_SLOTS; i++)
+		gm12u320->fb_update.fences[i].gm12u320 = gm12u320;
+	mutex_init(&gm12u320->fb_update.lock);
+	init_waitqueue_head(&gm12u320->fb_update.waitq);
+	init_usb_anchor(&gm12u320->pipeline.anchor);
+	spin_lock_init(&gm12u320->pipeline.lock);
+	init_completion(&gm12u320->pipeline.done);
+	hrtimer_init(&gm12u320->vblank.timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	gm12u320->vblank.timer.function = gm12u320_vblank_timer;
+	gm12u320->vblank.period_ns = VBLANK_MIN_PERIOD_NS;
+
+	dev = &gm12u320->dev;
+	ret = drm_dev_init(dev, &gm12u320_drm_driver, &interface->dev);
+	if (ret) {
+		kfree(gm12u320);
+		return ret;
+	}
+	dev->dev_private = gm12u320;
+
+	drm_mode_config_init(dev);
+	/* Overlay and cursor fbs may be smaller than the screen */
+	dev->mode_config.min_width = 1;
+	dev->mode_config.max_width = GM12U320_USER_WIDTH;
+	dev->mode_config.min_height = 1;
+	dev->mode_config.max_height = GM12U320_HEIGHT;
+	dev->mode_config.preferred_depth = 24;
+	dev->mode_config.prefer_shadow = 0;
+	dev->mode_config.funcs = &gm12u320_mode_config_funcs;
+
+	ret = gm12u320_usb_alloc(gm12u320);
+	if (ret)
+		goto err_put;
+
+	ret = gm12u320_set_ecomode(gm12u320);
+	if (ret)
+		goto err_put;
+
+	ret = gm12u320_conn_init(gm12u320);
+	if (ret)
+		goto err_put;
+
+	ret= drm_simple_display_pipe_init(&gm12u320->dev,
+					  &gm12u320->pipe,
+					  &gm12u320_pipe_funcs,
+					  gm12u320_pipe_formats,
+					  ARRAY_SIZE(gm12u320_pipe_formats),
+					  gm12u320_pipe_modifiers,
+					  &gm12u320->conn);
+	if (ret)
+		goto err_put;
+
+	drm_plane_enable_fb_damage_clips(&gm12u320->pipe.plane);
+	drm_crtc_enable_color_mgmt(&gm12u320->pipe.crtc, 0, true,
+				   GM12U320_GAMMA_SIZE);
+
+	/* For ceiling mounted and rear projection setups */
+	ret = drm_plane_create_rotation_property(&gm12u320->pipe.plane,
+						 DRM_MODE_ROTATE_0,
+						 DRM_MODE_ROTATE_0 |
+						 DRM_MODE_ROTATE_180 |
+						 DRM_MODE_REFLECT_X |
+						 DRM_MODE_REFLECT_Y);
+	if (ret)
+		goto err_put;
+
+	ret = gm12u320_planes_init(gm12u320);
+	if (ret)
+		goto err_put;
+
+	ret = drm_vblank_init(dev, 1);
+	if (ret)
+		goto err_put;
+
+	drm_mode_config_reset(dev);
+
+	usb_set_intfdata(interface, dev);
+	ret = drm_dev_register(dev, 0);
+	if (ret)
+		goto err_put;
+
+	drm_fbdev_generic_setup(dev, dev->mode_config.preferred_depth);
+
+	return 0;
+
+err_put:
+	drm_dev_put(dev);
+	return ret;
+}
+
+static void gm12u320_usb_disconnect(struct usb_interface *interface)
+{
+	struct drm_device *dev = usb_get_intfdata(interface);
+	struct gm12u320_device *gm12u320 = dev->dev_private;
+
+	gm12u320_stop_fb_update(gm12u320);
+	drm_dev_unplug(dev);
+	drm_dev_put(dev);
+}
+
+#ifdef CONFIG_PM
+static int gm12u320_suspend(struct usb_interface *interface,
+			    pm_message_t message)
+{
+	struct drm_device *dev = usb_get_intfdata(interface);
+	struct gm12u320_device *gm12u320 = dev->dev_private;
+
+	if (gm12u320->pipe_enabled)
+		gm12u320_stop_fb_update(gm12u320);
+
+	return 0;
+}
+
+static int gm12u320_resume(struct usb_interface *interface)
+{
+	struct drm_device *dev = usb_get_intfdata(interface);
+	struct gm12u320_device *gm12u320 = dev->dev_private;
+
+	gm12u320_set_ecomode(gm12u320);
+	if (gm12u320->pipe_enabled)
+		gm12u320_start_fb_update(gm12u320);
+
+	return 0;
+}
+#endif
+
+static const struct usb_device_id id_table[] = {
+	{ USB_DEVICE(0x1de1, 0xc102) },
+	{},
+};
+MODULE_DEVICE_TABLE(usb, id_table);
+
+static struct usb_driver gm12u320_usb_driver = {
+	.name = "gm12u320",
+	.probe = gm12u320_usb_probe,
+	.disconnect = gm12u320_usb_disconnect,
+	.id_table = id_table,
+#ifdef CONFIG_PM
+	.suspend = gm12u320_suspend,
+	.resume = gm12u320_resume,
+	.reset_resume = gm12u320_resume,
+#endif
+};
+
+static int __init gm12u320_init(void)
+{
+	gm12u320_select_convert();
+
+	return usb_register(&gm12u320_usb_driver);
+}
+
+static void __exit gm12u320_exit(void)
+{
+	usb_deregister(&gm12u320_usb_driver);
+}
+
+module_init(gm12u320_init);
+module_exit(gm12u320_exit);
+MODULE_AUTHOR("Hans de Goede <hdegoede@redhat.com>");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gm12u320
+
+#if !defined(_GM12U320_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _GM12U320_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <drm/drm_rect.h>
+
+#define GM12U320_XFER_CMD		0
+#define GM12U320_XFER_DATA		1
+#define GM12U320_XFER_STATUS		2
+
+#define show_xfer_stage(stage)						\
+	__print_symbolic(stage,						\
+			 { GM12U320_XFER_CMD, "cmd" },			\
+			 { GM12U320_XFER_DATA, "data" },		\
+			 { GM12U320_XFER_STATUS, "status" })
+
+TRACE_EVENT(gm12u320_mark_dirty,
+	TP_PROTO(const struct drm_rect *rect),
+	TP_ARGS(rect),
+	TP_STRUCT__entry(
+		__field(int, x1)
+		__field(int, y1)
+		__field(int, x2)
+		__field(int, y2)
+	),
+	TP_fast_assign(
+		__entry->x1 = rect->x1;
+		__entry->y1 = rect->y1;
+		__entry->x2 = rect->x2;
+		__entry->y2 = rect->y2;
+	),
+	TP_printk("rect=(%d,%d)-(%d,%d)",
+		  __entry->x1, __entry->y1, __entry->x2, __entry->y2)
+);
+
+DECLARE_EVENT_CLASS(gm12u320_convert,
+	TP_PROTO(int set, int rects),
+	TP_ARGS(set, rects),
+	TP_STRUCT__entry(
+		__field(int, set)
+		__field(int, rects)
+	),
+	TP_fast_assign(
+		__entry->set = set;
+		__entry->rects = rects;
+	),
+	TP_printk("set=%d rects=%d", __entry->set, __entry->rects)
+);
+
+DEFINE_EVENT(gm12u320_convert, gm12u320_convert_start,
+	TP_PROTO(int set, int rects),
+	TP_ARGS(set, rects)
+);
+
+DEFINE_EVENT(gm12u320_convert, gm12u320_convert_end,
+	TP_PROTO(int set, int rects),
+	TP_ARGS(set, rects)
+);
+
+TRACE_EVENT(gm12u320_frame_start,
+	TP_PROTO(int set, int frame, u32 blocks),
+	TP_ARGS(set, frame, blocks),
+	TP_STRUCT__entry(
+		__field(int, set)
+		__field(int, frame)
+		__field(u32, blocks)
+	),
+	TP_fast_assign(
+		__entry->set = set;
+		__entry->frame = frame;
+		__entry->blocks = blocks;
+	),
+	TP_printk("set=%d frame=%d blocks=0x%05x",
+		  __entry->set, __entry->frame, __entry->blocks)
+);
+
+/*
+ * The duration of a transfer stage is measured from the completion of the
+ * previous stage of the same block, or from submission for the command.
+ */
+TRACE_EVENT(gm12u320_xfer,
+	TP_PROTO(int block, int stage, int status, s64 duration_ns),
+	TP_ARGS(block, stage, status, duration_ns),
+	TP_STRUCT__entry(
+		__field(int, block)
+		__field(int, stage)
+		__field(int, status)
+		__field(s64, duration_ns)
+	),
+	TP_fast_assign(
+		__entry->block = block;
+		__entry->stage = stage;
+		__entry->status = status;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("block=%d %s status=%d duration=%lld ns",
+		  __entry->block, show_xfer_stage(__entry->stage),
+		  __entry->status, __entry->duration_ns)
+);
+
+TRACE_EVENT(gm12u320_draw,
+	TP_PROTO(int blocks, s64 frame_ns),
+	TP_ARGS(blocks, frame_ns),
+	TP_STRUCT__entry(
+		__field(int, blocks)
+		__field(s64, frame_ns)
+	),
+	TP_fast_assign(
+		__entry->blocks = blocks;
+		__entry->frame_ns = frame_ns;
+	),
+	TP_printk("blocks=%d frame=%lld ns",
+		  __entry->blocks, __entry->frame_ns)
+);
+
+TRACE_EVENT(gm12u320_wakeup,
+	TP_PROTO(bool idle),
+	TP_ARGS(idle),
+	TP_STRUCT__entry(
+		__field(bool, idle)
+	),
+	TP_fast_assign(
+		__entry->idle = idle;
+	),
+	TP_printk("%s", __entry->idle ? "idle" : "update")
+);
+
+#endif /* _GM12U320_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE gm12u320_trace
+#include <trace/define_trace.h>
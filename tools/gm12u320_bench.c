@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ *
+ * Userspace benchmark of the conversion of fb contents into data blocks, as
+ * done by gm12u320_convert_blocks(), for full frames and a set of damage
+ * patterns. This uses the scalar converters, the SIMD variants of the
+ * XRGB8888 conversion are only built into the module.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "gm12u320_convert.h"
+
+#define BENCH_MIN_NS			200000000LL
+#define BENCH_MAX_RECTS			8
+
+struct bench_format {
+	const char *name;
+	int cpp;
+	void (*convert)(u8 *dst, const u8 *src, int len);
+};
+
+static const struct bench_format bench_formats[] = {
+	{ "XRGB8888", 4, gm12u320_32bpp_to_24bpp_packed },
+	{ "XRGB8888 reflect-x", 4, gm12u320_32bpp_to_24bpp_reversed },
+	{ "RGB888", 3, gm12u320_24bpp_copy },
+	{ "XBGR8888", 4, gm12u320_xbgr8888_to_24bpp },
+	{ "RGB565", 2, gm12u320_rgb565_to_24bpp },
+};
+
+struct bench_damage {
+	const char *name;
+	int count;
+	struct drm_rect rects[BENCH_MAX_RECTS];
+};
+
+static const struct bench_damage bench_damages[] = {
+	{ "full frame", 1, { { 0, 0, GM12U320_USER_WIDTH, GM12U320_HEIGHT } } },
+	{ "top half", 1, { { 0, 0, GM12U320_USER_WIDTH, GM12U320_HEIGHT / 2 } } },
+	{ "single line", 1, { { 0, 240, GM12U320_USER_WIDTH, 241 } } },
+	{ "cursor 64x64", 1, { { 400, 200, 464, 264 } } },
+	/* Line 25 straddles the boundary of the first 2 blocks */
+	{ "block boundary", 1, { { 0, 20, GM12U320_USER_WIDTH, 30 } } },
+	{ "last block", 1, { { 0, 476, GM12U320_USER_WIDTH, 480 } } },
+	{ "column strip", 1, { { 800, 0, 848, GM12U320_HEIGHT } } },
+	{ "scattered 8", 8, {
+		{ 10, 10, 110, 30 }, { 700, 10, 840, 30 },
+		{ 100, 100, 164, 164 }, { 500, 150, 520, 400 },
+		{ 0, 300, 848, 316 }, { 300, 350, 500, 360 },
+		{ 20, 440, 60, 470 }, { 780, 450, 848, 480 } } },
+};
+
+static u8 *data_buf[GM12U320_BLOCK_COUNT];
+
+static s64 bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void bench_convert(const struct bench_format *format, const u8 *vaddr,
+			  int pitch, const struct drm_rect *rect)
+{
+	struct gm12u320_run_iter iter;
+	struct gm12u320_run run;
+	const u8 *src;
+
+	gm12u320_run_iter_init(&iter, rect, 0, GM12U320_BLOCK_COUNT - 1);
+	while (gm12u320_run_iter_next(&iter, &run)) {
+		if (format->convert == gm12u320_32bpp_to_24bpp_reversed)
+			src = vaddr + run.y * pitch +
+			      (GM12U320_USER_WIDTH - 1 - run.x) * format->cpp;
+		else
+			src = vaddr + run.y * pitch + run.x * format->cpp;
+
+		format->convert(data_buf[run.block] + DATA_BLOCK_HEADER_SIZE +
+				run.offset, src, run.len);
+	}
+}
+
+static void bench_run(const struct bench_format *format,
+		      const struct bench_damage *damage, const u8 *vaddr)
+{
+	const int pitch = GM12U320_USER_WIDTH * format->cpp;
+	s64 start, frame, total = 0, worst = 0;
+	long frames = 0, pixels = 0;
+	int i;
+
+	for (i = 0; i < damage->count; i++)
+		pixels += drm_rect_width(&damage->rects[i]) *
+			  drm_rect_height(&damage->rects[i]);
+
+	while (total < BENCH_MIN_NS) {
+		start = bench_now_ns();
+		for (i = 0; i < damage->count; i++)
+			bench_convert(format, vaddr, pitch, &damage->rects[i]);
+		frame = bench_now_ns() - start;
+
+		total += frame;
+		worst = max(worst, frame);
+		frames++;
+	}
+
+	printf("%-20s %-16s %8.1f MB/s %9.1f us/frame %9.1f us worst\n",
+	       format->name, damage->name,
+	       (double)pixels * format->cpp * frames * 1000.0 / total,
+	       total / 1000.0 / frames, worst / 1000.0);
+}
+
+int main(void)
+{
+	const size_t fb_size = GM12U320_USER_WIDTH * GM12U320_HEIGHT * 4;
+	unsigned int f, d;
+	size_t i;
+	u8 *vaddr;
+
+	vaddr = malloc(fb_size);
+	if (!vaddr)
+		return 1;
+
+	for (i = 0; i < fb_size; i++)
+		vaddr[i] = i * 7 + (i >> 12);
+
+	for (i = 0; i < GM12U320_BLOCK_COUNT; i++) {
+		data_buf[i] = calloc(1, DATA_BLOCK_SIZE);
+		if (!data_buf[i])
+			return 1;
+	}
+
+	for (f = 0; f < ARRAY_SIZE(bench_formats); f++)
+		for (d = 0; d < ARRAY_SIZE(bench_damages); d++)
+			bench_run(&bench_formats[f], &bench_damages[d], vaddr);
+
+	for (i = 0; i < GM12U320_BLOCK_COUNT; i++)
+		free(data_buf[i]);
+	free(vaddr);
+
+	return 0;
+}
@@ -0,0 +1,492 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ *
+ * Emulation of a GM12U320 projector as a FunctionFS gadget, so that the
+ * driver can be run and measured without a device, e.g. on a dummy_hcd
+ * loopback. This implements the protocol subset described above cmd_data[]
+ * in gm12u320_main.c: it answers the data, draw and misc commands with
+ * mass-storage style statuses, reassembles the data blocks into the 2 frame
+ * buffers of the device and on every draw prints a checksum of the shown
+ * frame and optionally dumps it as a PPM file.
+ *
+ * Usage: gm12u320_emu [-l <latency us>] [-d <dir>] [-q] <functionfs mount>
+ *
+ *   -l  delay each status reply by this much, to emulate a slower device
+ *   -d  write every drawn frame to <dir>/frame-<n>.ppm
+ *   -q  only print a summary every 100 frames, not a line per frame
+ *
+ * See README for setting up the gadget with configfs.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/usb/functionfs.h>
+
+#include "gm12u320_convert.h"
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x)			(x)
+#define cpu_to_le32(x)			(x)
+#else
+#define cpu_to_le16(x)			__builtin_bswap16(x)
+#define cpu_to_le32(x)			__builtin_bswap32(x)
+#endif
+
+/* These match the defines in gm12u320_main.c */
+#define CMD_SIZE			31
+#define READ_STATUS_SIZE		13
+#define READ_STATUS_RESULT		12
+#define MISC_VALUE_SIZE			4
+
+#define CMD_DATA			0xff
+#define CMD_DRAW			0xfe
+#define CMD_MISC			0xfd
+
+#define EMU_FRAME_SIZE			(GM12U320_REAL_WIDTH * \
+					 GM12U320_HEIGHT * 3)
+#define EMU_SUMMARY_FRAMES		100
+
+/*
+ * The endpoint files get named after the order of the descriptors, which is
+ * that of the endpoint numbers of the device.
+ */
+enum {
+	EMU_EP0,
+	EMU_MISC_RCV,
+	EMU_DATA_RCV,
+	EMU_DATA_SND,
+	EMU_MISC_SND,
+	EMU_EPS
+};
+
+#define EMU_EP_DESC(addr, maxpacket) {				\
+	.bLength = sizeof(struct usb_endpoint_descriptor_no_audio), \
+	.bDescriptorType = USB_DT_ENDPOINT,			\
+	.bEndpointAddress = (addr),				\
+	.bmAttributes = USB_ENDPOINT_XFER_BULK,			\
+	.wMaxPacketSize = cpu_to_le16(maxpacket),		\
+}
+
+#define EMU_DESCS(maxpacket) {					\
+	.intf = {						\
+		.bLength = sizeof(struct usb_interface_descriptor), \
+		.bDescriptorType = USB_DT_INTERFACE,		\
+		.bNumEndpoints = 4,				\
+		/* Keep usb-storage from binding */		\
+		.bInterfaceClass = USB_CLASS_VENDOR_SPEC,	\
+		.iInterface = 1,				\
+	},							\
+	.eps = {						\
+		EMU_EP_DESC(USB_DIR_IN | 1, maxpacket),		\
+		EMU_EP_DESC(USB_DIR_IN | 2, maxpacket),		\
+		EMU_EP_DESC(USB_DIR_OUT | 3, maxpacket),	\
+		EMU_EP_DESC(USB_DIR_OUT | 4, maxpacket),	\
+	},							\
+}
+
+struct emu_descs {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio eps[4];
+} __attribute__((packed));
+
+static const struct {
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	struct emu_descs fs_descs;
+	struct emu_descs hs_descs;
+} __attribute__((packed)) emu_descriptors = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.length = cpu_to_le32(sizeof(emu_descriptors)),
+		.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC |
+				     FUNCTIONFS_HAS_HS_DESC),
+	},
+	.fs_count = cpu_to_le32(5),
+	.hs_count = cpu_to_le32(5),
+	.fs_descs = EMU_DESCS(64),
+	.hs_descs = EMU_DESCS(512),
+};
+
+#define EMU_INTERFACE_NAME		"GM12U320 emulation"
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		const char str[sizeof(EMU_INTERFACE_NAME)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) emu_strings = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = cpu_to_le32(sizeof(emu_strings)),
+		.str_count = cpu_to_le32(1),
+		.lang_count = cpu_to_le32(1),
+	},
+	.lang0 = { cpu_to_le16(0x0409), EMU_INTERFACE_NAME },
+};
+
+static int ep_fd[EMU_EPS];
+static int latency_us;
+static const char *dump_dir;
+static bool quiet;
+
+/* The 2 frame buffers of the device, selected by the frame bit */
+static u8 frames[2][EMU_FRAME_SIZE];
+static u32 frame_blocks[2];
+static int shown;
+
+static struct {
+	unsigned long frames;
+	unsigned long blocks;
+	unsigned long bad_cmds;
+	unsigned long incomplete;
+	s64 start_ns;
+	s64 last_ns;
+} stats;
+
+static s64 emu_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Transfers fail with ESHUTDOWN etc. while the host has not configured us,
+ * the caller then starts over with the next command.
+ */
+static int emu_xfer(int ep, void *buf, size_t len, bool in)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		if (in)
+			ret = write(ep_fd[ep], (u8 *)buf + done, len - done);
+		else
+			ret = read(ep_fd[ep], (u8 *)buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			/* Avoid spinning while the gadget is disabled */
+			usleep(10000);
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static int emu_send_status(int ep, const u8 *cmd, bool ok)
+{
+	u8 status[READ_STATUS_SIZE] = { 'U', 'S', 'B', 'S' };
+
+	/* The tag, the residue stays 0 */
+	memcpy(&status[4], &cmd[4], 4);
+	status[READ_STATUS_RESULT] = !ok;
+
+	if (latency_us)
+		usleep(latency_us);
+
+	return emu_xfer(ep, status, sizeof(status), true);
+}
+
+static bool emu_cmd_valid(const u8 *cmd, u8 type)
+{
+	return !memcmp(cmd, "USBC", 4) && cmd[15] == type;
+}
+
+static int emu_block_size(int block)
+{
+	return block == GM12U320_BLOCK_COUNT - 1 ? DATA_LAST_BLOCK_SIZE :
+						   DATA_BLOCK_SIZE;
+}
+
+static bool emu_data(const u8 *cmd, u8 *buf)
+{
+	u32 len = cmd[8] | cmd[9] << 8 | cmd[10] << 16 | cmd[11] << 24;
+	int block = cmd[21] & 0x7f;
+	int frame = cmd[21] >> 7;
+	int content;
+
+	if (len > DATA_BLOCK_SIZE || emu_xfer(EMU_DATA_SND, buf, len, false))
+		return false;
+
+	if (block >= GM12U320_BLOCK_COUNT || cmd[20] != 0xfc - block * 4 ||
+	    len != emu_block_size(block))
+		return false;
+
+	content = len - DATA_BLOCK_HEADER_SIZE - DATA_BLOCK_FOOTER_SIZE;
+	memcpy(&frames[frame][block * DATA_BLOCK_CONTENT_SIZE],
+	       buf + DATA_BLOCK_HEADER_SIZE, content);
+	frame_blocks[frame] |= BIT(block);
+	shown = frame;
+	stats.blocks++;
+
+	return true;
+}
+
+/* FNV-1a over the visible pixels, skipping the padding of each line */
+static u64 emu_checksum(const u8 *frame)
+{
+	const int pad = (GM12U320_REAL_WIDTH - GM12U320_USER_WIDTH) / 2;
+	u64 hash = 0xcbf29ce484222325ULL;
+	const u8 *line;
+	int x, y;
+
+	for (y = 0; y < GM12U320_HEIGHT; y++) {
+		line = frame + (y * GM12U320_REAL_WIDTH + pad) * 3;
+		for (x = 0; x < GM12U320_USER_WIDTH * 3; x++)
+			hash = (hash ^ line[x]) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static void emu_dump(const u8 *frame, unsigned long n)
+{
+	const int pad = (GM12U320_REAL_WIDTH - GM12U320_USER_WIDTH) / 2;
+	const u8 *src;
+	char path[4096];
+	FILE *f;
+	int x, y;
+
+	snprintf(path, sizeof(path), "%s/frame-%06lu.ppm", dump_dir, n);
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return;
+	}
+
+	fprintf(f, "P6\n%d %d\n255\n", GM12U320_USER_WIDTH, GM12U320_HEIGHT);
+	for (y = 0; y < GM12U320_HEIGHT; y++) {
+		src = frame + (y * GM12U320_REAL_WIDTH + pad) * 3;
+		/* The device takes B, G, R */
+		for (x = 0; x < GM12U320_USER_WIDTH; x++, src += 3) {
+			fputc(src[2], f);
+			fputc(src[1], f);
+			fputc(src[0], f);
+		}
+	}
+
+	fclose(f);
+}
+
+static void emu_draw(void)
+{
+	s64 now = emu_now_ns();
+	double secs;
+
+	if (frame_blocks[shown] != GM12U320_ALL_BLOCKS)
+		stats.incomplete++;
+
+	if (!stats.frames)
+		stats.start_ns = now;
+	stats.frames++;
+
+	if (!quiet)
+		printf("frame %lu: buffer %d checksum %016llx %.1f ms\n",
+		       stats.frames, shown,
+		       (unsigned long long)emu_checksum(frames[shown]),
+		       stats.frames > 1 ? (now - stats.last_ns) / 1e6 : 0.0);
+	stats.last_ns = now;
+
+	if (dump_dir)
+		emu_dump(frames[shown], stats.frames);
+
+	if (quiet && !(stats.frames % EMU_SUMMARY_FRAMES)) {
+		secs = (now - stats.start_ns) / 1e9;
+		printf("%lu frames, %.1f fps, %.1f blocks per frame, %lu incomplete, %lu bad commands\n",
+		       stats.frames, secs > 0 ? (stats.frames - 1) / secs : 0.0,
+		       (double)stats.blocks / stats.frames, stats.incomplete,
+		       stats.bad_cmds);
+	}
+	fflush(stdout);
+}
+
+/* Data and draw commands, with their status on the data receive endpoint */
+static void *emu_data_thread(void *arg)
+{
+	static u8 buf[DATA_BLOCK_SIZE];
+	u8 cmd[CMD_SIZE];
+	bool ok;
+
+	for (;;) {
+		if (emu_xfer(EMU_DATA_SND, cmd, sizeof(cmd), false))
+			continue;
+
+		if (emu_cmd_valid(cmd, CMD_DATA)) {
+			ok = emu_data(cmd, buf);
+		} else if (emu_cmd_valid(cmd, CMD_DRAW)) {
+			emu_draw();
+			ok = true;
+		} else {
+			ok = false;
+		}
+
+		if (!ok)
+			stats.bad_cmds++;
+
+		emu_send_status(EMU_DATA_RCV, cmd, ok);
+	}
+
+	return NULL;
+}
+
+/* Misc commands, their value and status go to the misc receive endpoint */
+static void *emu_misc_thread(void *arg)
+{
+	u8 value[MISC_VALUE_SIZE] = {};
+	u8 cmd[CMD_SIZE];
+	bool ok;
+
+	for (;;) {
+		if (emu_xfer(EMU_MISC_SND, cmd, sizeof(cmd), false))
+			continue;
+
+		ok = emu_cmd_valid(cmd, CMD_MISC);
+		if (ok) {
+			if (latency_us)
+				usleep(latency_us);
+			if (emu_xfer(EMU_MISC_RCV, value, sizeof(value), true))
+				continue;
+		} else {
+			stats.bad_cmds++;
+		}
+
+		emu_send_status(EMU_MISC_RCV, cmd, ok);
+	}
+
+	return NULL;
+}
+
+static const char * const emu_event_names[] = {
+	[FUNCTIONFS_BIND] = "bind",
+	[FUNCTIONFS_UNBIND] = "unbind",
+	[FUNCTIONFS_ENABLE] = "enable",
+	[FUNCTIONFS_DISABLE] = "disable",
+	[FUNCTIONFS_SETUP] = "setup",
+	[FUNCTIONFS_SUSPEND] = "suspend",
+	[FUNCTIONFS_RESUME] = "resume",
+};
+
+/*
+ * The driver sends no control requests of its own, so stall any which get
+ * forwarded to us. FunctionFS stalls ep0 on an access in the wrong direction.
+ */
+static void emu_ep0_loop(void)
+{
+	struct usb_functionfs_event event;
+	ssize_t ret;
+
+	for (;;) {
+		ret = read(ep_fd[EMU_EP0], &event, sizeof(event));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("ep0");
+			return;
+		}
+
+		if (event.type < ARRAY_SIZE(emu_event_names))
+			fprintf(stderr, "gadget %s\n",
+				emu_event_names[event.type]);
+
+		if (event.type != FUNCTIONFS_SETUP)
+			continue;
+
+		if (event.u.setup.bRequestType & USB_DIR_IN)
+			ret = read(ep_fd[EMU_EP0], NULL, 0);
+		else
+			ret = write(ep_fd[EMU_EP0], NULL, 0);
+	}
+}
+
+static int emu_open(const char *mount)
+{
+	char path[4096];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/ep0", mount);
+	ep_fd[EMU_EP0] = open(path, O_RDWR);
+	if (ep_fd[EMU_EP0] < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (write(ep_fd[EMU_EP0], &emu_descriptors,
+		  sizeof(emu_descriptors)) < 0 ||
+	    write(ep_fd[EMU_EP0], &emu_strings, sizeof(emu_strings)) < 0) {
+		perror("writing descriptors");
+		return -1;
+	}
+
+	/* The endpoint files only exist after writing the descriptors */
+	for (i = EMU_MISC_RCV; i < EMU_EPS; i++) {
+		snprintf(path, sizeof(path), "%s/ep%d", mount, i);
+		ep_fd[i] = open(path, O_RDWR);
+		if (ep_fd[i] < 0) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void emu_usage(void)
+{
+	fprintf(stderr,
+		"Usage: gm12u320_emu [-l <latency us>] [-d <dir>] [-q] <functionfs mount>\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t data_thread, misc_thread;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:d:q")) != -1) {
+		switch (opt) {
+		case 'l':
+			latency_us = atoi(optarg);
+			break;
+		case 'd':
+			dump_dir = optarg;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			emu_usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		emu_usage();
+
+	if (emu_open(argv[optind]))
+		return 1;
+
+	if (pthread_create(&data_thread, NULL, emu_data_thread, NULL) ||
+	    pthread_create(&misc_thread, NULL, emu_misc_thread, NULL)) {
+		fprintf(stderr, "Error creating threads\n");
+		return 1;
+	}
+
+	fprintf(stderr, "Ready, bind the gadget to a UDC now\n");
+	emu_ep0_loop();
+
+	return 1;
+}
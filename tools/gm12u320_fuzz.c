@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ *
+ * Fuzz target checking the split of rects into per data block runs by
+ * gm12u320_run_iter_*() and gm12u320_rect_blocks() against a naive per pixel
+ * reference. Each input is a rect plus a range of data blocks, clipped to
+ * the screen the way the driver clips damage.
+ *
+ * Build with libFuzzer ("make fuzz"), or with GM12U320_FUZZ_MAIN defined
+ * for a standalone driver feeding it random inputs ("make fuzz-check").
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gm12u320_convert.h"
+
+#define FUZZ_PAD		((GM12U320_REAL_WIDTH - GM12U320_USER_WIDTH) / 2)
+#define FUZZ_PIXELS		(GM12U320_BLOCK_COUNT * DATA_BLOCK_CONTENT_SIZE / 3)
+
+/* Per device pixel, how many runs covered it */
+static u8 covered[FUZZ_PIXELS];
+
+static int fuzz_offset(int x, int y)
+{
+	return (y * GM12U320_REAL_WIDTH + x + FUZZ_PAD) * 3;
+}
+
+static u16 fuzz_get(const u8 *data, size_t size, size_t i)
+{
+	return i * 2 + 1 < size ? data[i * 2] | data[i * 2 + 1] << 8 : 0;
+}
+
+static void fuzz_fail(const char *what, const struct drm_rect *rect,
+		      int first, int last)
+{
+	fprintf(stderr, "%s: rect (%d,%d)-(%d,%d) blocks %d-%d\n", what,
+		rect->x1, rect->y1, rect->x2, rect->y2, first, last);
+	abort();
+}
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+	struct gm12u320_run_iter iter;
+	struct gm12u320_run run;
+	struct drm_rect rect;
+	int i, x, y, block, first, last, offset;
+	u32 mask;
+
+	rect.x1 = fuzz_get(data, size, 0) % GM12U320_USER_WIDTH;
+	rect.y1 = fuzz_get(data, size, 1) % GM12U320_HEIGHT;
+	rect.x2 = rect.x1 + 1 +
+		  fuzz_get(data, size, 2) % (GM12U320_USER_WIDTH - rect.x1);
+	rect.y2 = rect.y1 + 1 +
+		  fuzz_get(data, size, 3) % (GM12U320_HEIGHT - rect.y1);
+	first = fuzz_get(data, size, 4) % GM12U320_BLOCK_COUNT;
+	last = first + fuzz_get(data, size, 5) % (GM12U320_BLOCK_COUNT - first);
+
+	memset(covered, 0, sizeof(covered));
+
+	gm12u320_run_iter_init(&iter, &rect, first, last);
+	while (gm12u320_run_iter_next(&iter, &run)) {
+		if (run.len <= 0)
+			fuzz_fail("empty run", &rect, first, last);
+
+		for (i = 0; i < run.len; i++) {
+			x = run.x + i;
+			y = run.y;
+			offset = fuzz_offset(x, y);
+
+			if (x < rect.x1 || x >= rect.x2 ||
+			    y < rect.y1 || y >= rect.y2)
+				fuzz_fail("run outside of rect", &rect,
+					  first, last);
+			if (offset / DATA_BLOCK_CONTENT_SIZE != run.block ||
+			    offset % DATA_BLOCK_CONTENT_SIZE !=
+					run.offset + i * 3)
+				fuzz_fail("run at wrong offset", &rect,
+					  first, last);
+			if (covered[offset / 3]++)
+				fuzz_fail("pixel covered twice", &rect,
+					  first, last);
+		}
+	}
+
+	mask = gm12u320_rect_blocks(&rect);
+	for (y = rect.y1; y < rect.y2; y++) {
+		for (x = rect.x1; x < rect.x2; x++) {
+			offset = fuzz_offset(x, y);
+			block = offset / DATA_BLOCK_CONTENT_SIZE;
+
+			if (covered[offset / 3] !=
+			    (block >= first && block <= last))
+				fuzz_fail("pixel not covered", &rect,
+					  first, last);
+			if (!(mask & BIT(block)))
+				fuzz_fail("block missing from mask", &rect,
+					  first, last);
+		}
+	}
+
+	/* The mask must not contain blocks the rect does not touch */
+	block = fuzz_offset(rect.x1, rect.y1) / DATA_BLOCK_CONTENT_SIZE;
+	if (mask & (BIT(block) - 1))
+		fuzz_fail("mask starts too early", &rect, first, last);
+	block = (fuzz_offset(rect.x2 - 1, rect.y2 - 1) + 2) /
+		DATA_BLOCK_CONTENT_SIZE;
+	if (mask & ~(BIT(block + 1) - 1))
+		fuzz_fail("mask ends too late", &rect, first, last);
+
+	return 0;
+}
+
+#ifdef GM12U320_FUZZ_MAIN
+int main(int argc, char **argv)
+{
+	long i, iterations = argc > 1 ? atol(argv[1]) : 100000;
+	u8 data[12];
+	size_t j;
+
+	srand(1);
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < sizeof(data); j++)
+			data[j] = rand();
+		LLVMFuzzerTestOneInput(data, sizeof(data));
+	}
+
+	printf("%ld inputs ok\n", iterations);
+	return 0;
+}
+#endif
@@ -0,0 +1,361 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ *
+ * Load generator for the driver: sets a mode with a dumb buffer on the
+ * gm12u320 DRM device, then redraws part of it and flushes that with
+ * DIRTYFB as fast as possible, or at a given rate, reporting the achieved
+ * update rate and the DIRTYFB latency. Combined with gm12u320_emu this
+ * measures the driver without a device. Run it without a compositor, so
+ * that it gets to be DRM master.
+ *
+ * Usage: gm12u320_loadgen [-d <card>] [-t <seconds>] [-r <rate>]
+ *                         [-p full|rect|line|random] [-s <w>x<h>]
+ *
+ *   -d  the DRM device, by default the first one driven by gm12u320
+ *   -t  run time, default 10 seconds
+ *   -r  updates per second, default as fast as DIRTYFB allows
+ *   -p  damage pattern, default full
+ *   -s  size of the rect for the rect and random patterns, default 64x64
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#define ARRAY_SIZE(a)			(sizeof(a) / sizeof((a)[0]))
+
+enum loadgen_pattern {
+	LOADGEN_FULL,
+	LOADGEN_RECT,
+	LOADGEN_LINE,
+	LOADGEN_RANDOM,
+};
+
+static const char * const loadgen_pattern_names[] = {
+	[LOADGEN_FULL] = "full",
+	[LOADGEN_RECT] = "rect",
+	[LOADGEN_LINE] = "line",
+	[LOADGEN_RANDOM] = "random",
+};
+
+struct loadgen {
+	int fd;
+	uint32_t conn_id;
+	uint32_t crtc_id;
+	drmModeModeInfo mode;
+	drmModeCrtc *saved_crtc;
+	uint32_t handle;
+	uint32_t fb_id;
+	uint32_t pitch;
+	uint64_t size;
+	uint32_t *map;
+};
+
+static int64_t loadgen_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool loadgen_is_gm12u320(int fd)
+{
+	drmVersionPtr version = drmGetVersion(fd);
+	bool ret;
+
+	if (!version)
+		return false;
+
+	ret = !strcmp(version->name, "gm12u320");
+	drmFreeVersion(version);
+	return ret;
+}
+
+static int loadgen_open(const char *card)
+{
+	char path[64];
+	int i, fd;
+
+	if (card)
+		return open(card, O_RDWR | O_CLOEXEC);
+
+	for (i = 0; i < DRM_MAX_MINOR; i++) {
+		snprintf(path, sizeof(path), DRM_DEV_NAME, DRM_DIR_NAME, i);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		if (loadgen_is_gm12u320(fd))
+			return fd;
+		close(fd);
+	}
+
+	errno = ENODEV;
+	return -1;
+}
+
+static int loadgen_setup(struct loadgen *lg)
+{
+	struct drm_mode_create_dumb create = { .bpp = 32 };
+	struct drm_mode_map_dumb map = {};
+	drmModeConnector *conn = NULL;
+	drmModeRes *res;
+	int i, ret = -1;
+
+	res = drmModeGetResources(lg->fd);
+	if (!res || !res->count_crtcs) {
+		fprintf(stderr, "No KMS resources\n");
+		goto out;
+	}
+
+	for (i = 0; i < res->count_connectors; i++) {
+		conn = drmModeGetConnector(lg->fd, res->connectors[i]);
+		if (conn && conn->connection == DRM_MODE_CONNECTED &&
+		    conn->count_modes)
+			break;
+		drmModeFreeConnector(conn);
+		conn = NULL;
+	}
+	if (!conn) {
+		fprintf(stderr, "No connected connector\n");
+		goto out;
+	}
+
+	lg->conn_id = conn->connector_id;
+	lg->crtc_id = res->crtcs[0];
+	lg->mode = conn->modes[0];
+	lg->saved_crtc = drmModeGetCrtc(lg->fd, lg->crtc_id);
+
+	create.width = lg->mode.hdisplay;
+	create.height = lg->mode.vdisplay;
+	if (drmIoctl(lg->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+		perror("CREATE_DUMB");
+		goto out;
+	}
+	lg->handle = create.handle;
+	lg->pitch = create.pitch;
+	lg->size = create.size;
+
+	if (drmModeAddFB(lg->fd, create.width, create.height, 24, 32,
+			 lg->pitch, lg->handle, &lg->fb_id)) {
+		perror("ADDFB");
+		goto out;
+	}
+
+	map.handle = lg->handle;
+	if (drmIoctl(lg->fd, DRM_IOCTL_MODE_MAP_DUMB, &map)) {
+		perror("MAP_DUMB");
+		goto out;
+	}
+
+	lg->map = mmap(NULL, lg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       lg->fd, map.offset);
+	if (lg->map == MAP_FAILED) {
+		perror("mmap");
+		lg->map = NULL;
+		goto out;
+	}
+	memset(lg->map, 0, lg->size);
+
+	if (drmModeSetCrtc(lg->fd, lg->crtc_id, lg->fb_id, 0, 0,
+			   &lg->conn_id, 1, &lg->mode)) {
+		perror("SETCRTC");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	drmModeFreeConnector(conn);
+	drmModeFreeResources(res);
+	return ret;
+}
+
+static void loadgen_teardown(struct loadgen *lg)
+{
+	struct drm_mode_destroy_dumb destroy = { .handle = lg->handle };
+	drmModeCrtc *crtc = lg->saved_crtc;
+
+	if (crtc && crtc->mode_valid)
+		drmModeSetCrtc(lg->fd, crtc->crtc_id, crtc->buffer_id,
+			       crtc->x, crtc->y, &lg->conn_id, 1, &crtc->mode);
+	else if (crtc)
+		drmModeSetCrtc(lg->fd, crtc->crtc_id, 0, 0, 0, NULL, 0, NULL);
+	drmModeFreeCrtc(crtc);
+	if (lg->map)
+		munmap(lg->map, lg->size);
+	if (lg->fb_id)
+		drmModeRmFB(lg->fd, lg->fb_id);
+	if (lg->handle)
+		drmIoctl(lg->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+}
+
+/* The clip of update n, wrapping around the screen */
+static void loadgen_clip(const struct loadgen *lg,
+			 enum loadgen_pattern pattern, int w, int h,
+			 unsigned long n, drmModeClip *clip)
+{
+	const int width = lg->mode.hdisplay;
+	const int height = lg->mode.vdisplay;
+	int x = 0, y = 0;
+
+	switch (pattern) {
+	case LOADGEN_FULL:
+		w = width;
+		h = height;
+		break;
+	case LOADGEN_RECT:
+		x = (n * 8) % (width - w + 1);
+		y = (n * 8 / (width - w + 1) * h) % (height - h + 1);
+		break;
+	case LOADGEN_LINE:
+		w = width;
+		h = 1;
+		y = n % height;
+		break;
+	case LOADGEN_RANDOM:
+		x = rand() % (width - w + 1);
+		y = rand() % (height - h + 1);
+		break;
+	}
+
+	clip->x1 = x;
+	clip->y1 = y;
+	clip->x2 = x + w;
+	clip->y2 = y + h;
+}
+
+static void loadgen_draw(struct loadgen *lg, const drmModeClip *clip,
+			 unsigned long n)
+{
+	uint32_t color = (n * 0x010203) & 0xffffff;
+	uint32_t *line;
+	int x, y;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		line = lg->map + y * lg->pitch / 4;
+		for (x = clip->x1; x < clip->x2; x++)
+			line[x] = color ^ (x << 8) ^ y;
+	}
+}
+
+static void loadgen_usage(void)
+{
+	fprintf(stderr,
+		"Usage: gm12u320_loadgen [-d <card>] [-t <seconds>] [-r <rate>]\n"
+		"                        [-p full|rect|line|random] [-s <w>x<h>]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	enum loadgen_pattern pattern = LOADGEN_FULL;
+	int64_t start, now, before, lat, lat_max = 0, lat_total = 0;
+	int64_t period = 0, next;
+	unsigned long n, failed = 0, pixels = 0;
+	struct loadgen lg = {};
+	const char *card = NULL;
+	int w = 64, h = 64;
+	double secs = 10;
+	drmModeClip clip;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:r:p:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			card = optarg;
+			break;
+		case 't':
+			secs = atof(optarg);
+			break;
+		case 'r':
+			if (atoi(optarg) <= 0)
+				loadgen_usage();
+			period = 1000000000LL / atoi(optarg);
+			break;
+		case 'p':
+			for (i = 0; i < ARRAY_SIZE(loadgen_pattern_names); i++) {
+				if (!strcmp(optarg, loadgen_pattern_names[i]))
+					break;
+			}
+			if (i == ARRAY_SIZE(loadgen_pattern_names))
+				loadgen_usage();
+			pattern = i;
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &w, &h) != 2 ||
+			    w <= 0 || h <= 0)
+				loadgen_usage();
+			break;
+		default:
+			loadgen_usage();
+		}
+	}
+
+	lg.fd = loadgen_open(card);
+	if (lg.fd < 0) {
+		perror(card ? card : "No gm12u320 DRM device");
+		return 1;
+	}
+
+	if (loadgen_setup(&lg)) {
+		loadgen_teardown(&lg);
+		return 1;
+	}
+
+	if (w > lg.mode.hdisplay)
+		w = lg.mode.hdisplay;
+	if (h > lg.mode.vdisplay)
+		h = lg.mode.vdisplay;
+
+	start = loadgen_now_ns();
+	next = start;
+	for (n = 0; ; n++) {
+		now = loadgen_now_ns();
+		if (now - start >= secs * 1e9)
+			break;
+
+		if (period) {
+			next += period;
+			if (next > now)
+				usleep((next - now) / 1000);
+		}
+
+		loadgen_clip(&lg, pattern, w, h, n, &clip);
+		loadgen_draw(&lg, &clip, n);
+
+		before = loadgen_now_ns();
+		if (drmModeDirtyFB(lg.fd, lg.fb_id, &clip, 1))
+			failed++;
+		lat = loadgen_now_ns() - before;
+
+		lat_total += lat;
+		if (lat > lat_max)
+			lat_max = lat;
+		pixels += (clip.x2 - clip.x1) * (clip.y2 - clip.y1);
+	}
+
+	secs = (loadgen_now_ns() - start) / 1e9;
+	printf("%s: %lu updates in %.1f s, %.1f updates/s, %.1f Mpixels/s, %lu failed\n",
+	       loadgen_pattern_names[pattern], n, secs, n / secs,
+	       pixels / secs / 1e6, failed);
+	if (n)
+		printf("DIRTYFB latency: %.1f us average, %.1f us worst\n",
+		       lat_total / 1e3 / n, lat_max / 1e3);
+
+	loadgen_teardown(&lg);
+	close(lg.fd);
+
+	return 0;
+}
@@ -0,0 +1,436 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ *
+ * Unit tests of the device independent parts of the driver: the pixel
+ * converters against known answers and with color correction, the data
+ * block layout, damage merging and the coalescing of pending frames and
+ * their flip events. Run them with "make check", this exits non-zero if any
+ * test fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gm12u320_convert.h"
+#include "gm12u320_damage.h"
+
+#define TEST_KNOWN_PIXELS		5
+
+/* Stand-ins, the pending frame code only passes these around */
+struct drm_framebuffer {
+	int id;
+};
+
+struct drm_pending_vblank_event {
+	int id;
+};
+
+static int test_failed;
+
+#define test_check(cond, ...) do {				\
+	if (!(cond)) {						\
+		fprintf(stderr, "%s:%d: ", __func__, __LINE__);	\
+		fprintf(stderr, __VA_ARGS__);			\
+		fprintf(stderr, "\n");				\
+		test_failed++;					\
+	}							\
+} while (0)
+
+/*
+ * Known answers: pure red, green and blue, white and a mixed color, which
+ * the device wants in B, G, R byte order.
+ */
+static const u8 test_known_out[TEST_KNOWN_PIXELS * 3] = {
+	0x00, 0x00, 0xff,  0x00, 0xff, 0x00,  0xff, 0x00, 0x00,
+	0xff, 0xff, 0xff,  0x56, 0x34, 0x12,
+};
+
+/* The RGB565 versions, the low bits get filled from the high bits */
+static const u8 test_known_out_565[TEST_KNOWN_PIXELS * 3] = {
+	0x00, 0x00, 0xff,  0x00, 0xff, 0x00,  0xff, 0x00, 0x00,
+	0xff, 0xff, 0xff,  0x84, 0x82, 0x84,
+};
+
+static const u8 test_known_xrgb8888[] = {
+	0x00, 0x00, 0xff, 0x00,  0x00, 0xff, 0x00, 0x00,
+	0xff, 0x00, 0x00, 0x00,  0xff, 0xff, 0xff, 0xff,
+	0x56, 0x34, 0x12, 0x80,
+};
+
+static const u8 test_known_xbgr8888[] = {
+	0xff, 0x00, 0x00, 0x00,  0x00, 0xff, 0x00, 0x00,
+	0x00, 0x00, 0xff, 0x00,  0xff, 0xff, 0xff, 0xff,
+	0x12, 0x34, 0x56, 0x80,
+};
+
+static const u8 test_known_rgb888[] = {
+	0x00, 0x00, 0xff,  0x00, 0xff, 0x00,  0xff, 0x00, 0x00,
+	0xff, 0xff, 0xff,  0x56, 0x34, 0x12,
+};
+
+/* Little endian 0xf800, 0x07e0, 0x001f, 0xffff and 0x8410 */
+static const u8 test_known_rgb565[] = {
+	0x00, 0xf8,  0xe0, 0x07,  0x1f, 0x00,  0xff, 0xff,  0x10, 0x84,
+};
+
+static const struct test_format {
+	const char *name;
+	int cpp;
+	void (*convert)(u8 *dst, const u8 *src, int len);
+	void (*reversed)(u8 *dst, const u8 *src, int len);
+	void (*convert_color)(u8 *dst, const u8 *src, int len, int step,
+			      const struct gm12u320_color *color);
+	const u8 *known_src;
+	const u8 *known_out;
+} test_formats[] = {
+	{ "XRGB8888", 4, gm12u320_32bpp_to_24bpp_packed,
+	  gm12u320_32bpp_to_24bpp_reversed, gm12u320_bgr_to_24bpp_color,
+	  test_known_xrgb8888, test_known_out },
+	{ "XBGR8888", 4, gm12u320_xbgr8888_to_24bpp,
+	  gm12u320_xbgr8888_to_24bpp_reversed, gm12u320_rgb_to_24bpp_color,
+	  test_known_xbgr8888, test_known_out },
+	{ "RGB888", 3, gm12u320_24bpp_copy, gm12u320_24bpp_reversed,
+	  gm12u320_bgr_to_24bpp_color,
+	  test_known_rgb888, test_known_out },
+	{ "RGB565", 2, gm12u320_rgb565_to_24bpp,
+	  gm12u320_rgb565_to_24bpp_reversed, gm12u320_rgb565_to_24bpp_color,
+	  test_known_rgb565, test_known_out_565 },
+};
+
+static struct gm12u320_color test_color;
+
+/*
+ * Check both converters of a format against the known answers, so that
+ * mistakes shared by the forward and reflected variants do not go
+ * unnoticed, and the reflected one against the forward one on a full line.
+ */
+static void test_convert(const struct test_format *fmt)
+{
+	const int len = GM12U320_USER_WIDTH;
+	u8 src[GM12U320_USER_WIDTH * 4];
+	u8 fwd[GM12U320_USER_WIDTH * 3];
+	u8 rev[GM12U320_USER_WIDTH * 3];
+	int i, n = TEST_KNOWN_PIXELS;
+
+	fmt->convert(fwd, fmt->known_src, n);
+	test_check(!memcmp(fwd, fmt->known_out, n * 3),
+		   "%s known answers", fmt->name);
+
+	fmt->reversed(rev, fmt->known_src + (n - 1) * fmt->cpp, n);
+	for (i = 0; i < n; i++)
+		test_check(!memcmp(rev + i * 3,
+				   fmt->known_out + (n - 1 - i) * 3, 3),
+			   "%s reflected known answer %d", fmt->name, i);
+
+	for (i = 0; i < (int)sizeof(src); i++)
+		src[i] = i * 7 + (i >> 8);
+
+	fmt->convert(fwd, src, len);
+	fmt->reversed(rev, src + (len - 1) * fmt->cpp, len);
+	for (i = 0; i < len; i++)
+		test_check(!memcmp(fwd + i * 3, rev + (len - 1 - i) * 3, 3),
+			   "%s reflected pixel %d", fmt->name, i);
+}
+
+/* The correction of a converted pixel, as a plain reference */
+static void test_color_ref(const struct gm12u320_color *color, u8 *pixel)
+{
+	int i, j, v, out[3];
+
+	for (i = 0; i < 3; i++) {
+		v = pixel[i];
+		if (color->ctm) {
+			v = 128;
+			for (j = 0; j < 3; j++)
+				v += color->ctm_lut[i][j][pixel[j]];
+			v = clamp_val(v >> 8, 0, 255);
+		}
+		out[i] = color->gamma[i][v];
+	}
+
+	for (i = 0; i < 3; i++)
+		pixel[i] = out[i];
+}
+
+/*
+ * The converters with color correction must match converting first and
+ * correcting after, both for plain gamma and with a CTM which mixes and
+ * clamps the channels, forward and reflected.
+ */
+static void test_convert_color(const struct test_format *fmt)
+{
+	const int len = GM12U320_USER_WIDTH;
+	u8 src[GM12U320_USER_WIDTH * 4];
+	u8 ref[GM12U320_USER_WIDTH * 3];
+	u8 out[GM12U320_USER_WIDTH * 3];
+	int i, j, k, v, ctm, rev;
+
+	for (i = 0; i < (int)sizeof(src); i++)
+		src[i] = i * 13 + (i >> 7);
+
+	for (i = 0; i < 3; i++) {
+		for (v = 0; v < 256; v++) {
+			test_color.gamma[i][v] = (255 - v) ^ (i * 0x11);
+			for (j = 0; j < 3; j++) {
+				k = (i == j) ? 300 : (i - j) * 40;
+				test_color.ctm_lut[i][j][v] = k * v;
+			}
+		}
+	}
+
+	for (ctm = 0; ctm < 2; ctm++) {
+		test_color.ctm = ctm;
+		for (rev = 0; rev < 2; rev++) {
+			const u8 *line = src + (rev ? (len - 1) * fmt->cpp : 0);
+
+			(rev ? fmt->reversed : fmt->convert)(ref, line, len);
+			for (i = 0; i < len; i++)
+				test_color_ref(&test_color, ref + i * 3);
+
+			fmt->convert_color(out, line, len,
+					   rev ? -fmt->cpp : fmt->cpp,
+					   &test_color);
+			test_check(!memcmp(out, ref, sizeof(ref)),
+				   "%s color%s%s", fmt->name,
+				   ctm ? " ctm" : "", rev ? " reflected" : "");
+		}
+	}
+}
+
+/*
+ * Every pixel must land exactly once at its place in the device layout,
+ * also when converting block by block, and rows straddling a block boundary
+ * must be split there. The last block is shorter than the others.
+ */
+static void test_layout(void)
+{
+	const int x_offset = (GM12U320_REAL_WIDTH - GM12U320_USER_WIDTH) / 2;
+	struct drm_rect rect = { 0, 0, GM12U320_USER_WIDTH, GM12U320_HEIGHT };
+	struct gm12u320_run_iter iter;
+	struct gm12u320_run run;
+	int block, pos, size, pixels = 0;
+	u32 blocks;
+
+	for (block = 0; block < GM12U320_BLOCK_COUNT; block++) {
+		size = (block == GM12U320_BLOCK_COUNT - 1) ?
+		       DATA_LAST_BLOCK_CONTENT_SIZE : DATA_BLOCK_CONTENT_SIZE;
+
+		gm12u320_run_iter_init(&iter, &rect, block, block);
+		while (gm12u320_run_iter_next(&iter, &run)) {
+			pos = (run.y * GM12U320_REAL_WIDTH + run.x + x_offset) * 3;
+			test_check(run.block == block && run.len > 0 &&
+				   pos == block * DATA_BLOCK_CONTENT_SIZE +
+					  run.offset &&
+				   run.offset + run.len * 3 <= size &&
+				   run.x + run.len <= GM12U320_USER_WIDTH,
+				   "block %d run at %d,%d len %d", block,
+				   run.x, run.y, run.len);
+			pixels += run.len;
+		}
+	}
+
+	test_check(pixels == GM12U320_USER_WIDTH * GM12U320_HEIGHT,
+		   "%d pixels in the frame", pixels);
+
+	/* The block mask of each row must match the blocks it lands in */
+	for (rect.y1 = 0; rect.y1 < GM12U320_HEIGHT; rect.y1++) {
+		rect.y2 = rect.y1 + 1;
+		blocks = 0;
+		gm12u320_run_iter_init(&iter, &rect, 0,
+				       GM12U320_BLOCK_COUNT - 1);
+		while (gm12u320_run_iter_next(&iter, &run))
+			blocks |= BIT(run.block);
+		test_check(blocks == gm12u320_rect_blocks(&rect),
+			   "block mask of row %d", rect.y1);
+	}
+}
+
+/*
+ * The header and footer at both ends of a data block, with the content
+ * untouched in between, and a data command announcing the size and index
+ * of the block while leaving the other bytes alone.
+ */
+static void test_blocks(void)
+{
+	static u8 buf[DATA_BLOCK_SIZE];
+	int i, block, size, content;
+	u8 cmd[32];
+
+	for (block = 0; block < GM12U320_BLOCK_COUNT; block++) {
+		if (block == GM12U320_BLOCK_COUNT - 1) {
+			size = DATA_LAST_BLOCK_SIZE;
+			content = DATA_LAST_BLOCK_CONTENT_SIZE;
+		} else {
+			size = DATA_BLOCK_SIZE;
+			content = DATA_BLOCK_CONTENT_SIZE;
+		}
+
+		memset(buf, 0xaa, sizeof(buf));
+		gm12u320_block_init(buf, block);
+
+		test_check(gm12u320_block_size(block) == size,
+			   "block %d size", block);
+		/* The header also holds the content size, at offset 76 */
+		test_check(get_unaligned_le16(buf + 76) == content,
+			   "block %d header content size", block);
+		test_check(buf[64] == 0xfb && buf[65] == 0x14,
+			   "block %d header magic", block);
+		for (i = 0; i < content; i++) {
+			if (buf[DATA_BLOCK_HEADER_SIZE + i] != 0xaa)
+				break;
+		}
+		test_check(i == content, "block %d content overwritten at %d",
+			   block, i);
+		test_check(buf[size - DATA_BLOCK_FOOTER_SIZE] == 0xfb &&
+			   buf[size - 1] == 0x4f,
+			   "block %d footer", block);
+
+		memset(cmd, 0x55, sizeof(cmd));
+		gm12u320_data_cmd_init(cmd, block);
+		test_check(get_unaligned_le16(&cmd[8]) == size &&
+			   cmd[20] == 0xfc - block * 4 && cmd[21] == block,
+			   "block %d data command", block);
+		for (i = 0; i < (int)sizeof(cmd); i++) {
+			if (i == 8 || i == 9 || i == 20 || i == 21)
+				continue;
+			test_check(cmd[i] == 0x55,
+				   "block %d data command byte %d", block, i);
+		}
+	}
+}
+
+static bool test_damage_covers(const struct gm12u320_damage *damage,
+			       const struct drm_rect *rect)
+{
+	int i;
+
+	for (i = 0; i < damage->count; i++) {
+		if (gm12u320_rect_contains(&damage->rects[i], rect))
+			return true;
+	}
+
+	return false;
+}
+
+/* Each added rect must stay covered by a single (merged) damage rect */
+static void test_damage(void)
+{
+	struct drm_rect rects[4 * GM12U320_MAX_DAMAGE_RECTS];
+	struct gm12u320_damage damage = {};
+	struct drm_rect empty = { 10, 10, 10, 20 };
+	u32 seed = 0x12345678, blocks = 0;
+	int i, j, w, h;
+
+	for (i = 0; i < (int)ARRAY_SIZE(rects); i++) {
+		seed = seed * 1103515245 + 12345;
+		w = 1 + (seed >> 8) % 128;
+		h = 1 + (seed >> 16) % 64;
+		rects[i].x1 = (seed >> 4) % (GM12U320_USER_WIDTH - w);
+		rects[i].y1 = (seed >> 12) % (GM12U320_HEIGHT - h);
+		rects[i].x2 = rects[i].x1 + w;
+		rects[i].y2 = rects[i].y1 + h;
+		gm12u320_damage_add(&damage, &rects[i]);
+		blocks |= gm12u320_rect_blocks(&rects[i]);
+
+		test_check(damage.count <= GM12U320_MAX_DAMAGE_RECTS,
+			   "%d damage rects", damage.count);
+		for (j = 0; j <= i; j++)
+			test_check(test_damage_covers(&damage, &rects[j]),
+				   "rect %d lost after adding %d", j, i);
+	}
+
+	/* Merging may only add blocks, never lose any */
+	test_check((gm12u320_damage_blocks(&damage) & blocks) == blocks,
+		   "damage block mask");
+
+	i = damage.count;
+	gm12u320_damage_add(&damage, &empty);
+	test_check(damage.count == i, "empty rect added");
+}
+
+/*
+ * Updates of the pending fb coalesce, only the last flip event stays
+ * pending and the replaced ones get handed back to be sent right away. A
+ * new fb replaces the pending one with its damage. Once the worker is dead
+ * events never get queued.
+ */
+static void test_pending(void)
+{
+	struct drm_framebuffer fb_a = { 1 }, fb_b = { 2 };
+	struct drm_pending_vblank_event ev_a = { 1 }, ev_b = { 2 }, ev_c = { 3 };
+	struct gm12u320_damage d1 = { .count = 1, .rects = {{ 0, 0, 8, 8 }} };
+	struct gm12u320_damage d2 = { .count = 1, .rects = {{ 100, 200, 108, 208 }} };
+	struct gm12u320_damage d3 = { .count = 1, .rects = {{ 50, 50, 60, 60 }} };
+	struct drm_pending_vblank_event *old_event, *event;
+	struct gm12u320_pending pending = {};
+	struct gm12u320_damage damage;
+	struct drm_framebuffer *old_fb, *fb;
+	bool replaced;
+
+	replaced = gm12u320_pending_mark(&pending, &fb_a, &d1, &ev_a,
+					 &old_fb, &old_event);
+	test_check(replaced && !old_fb && !old_event, "first mark");
+	test_check(pending.fb == &fb_a && pending.event == &ev_a,
+		   "first mark pending");
+
+	/* Same fb, the damage gets merged and the old event handed back */
+	replaced = gm12u320_pending_mark(&pending, &fb_a, &d2, &ev_b,
+					 &old_fb, &old_event);
+	test_check(!replaced && !old_fb && old_event == &ev_a,
+		   "coalesced mark");
+	test_check(pending.event == &ev_b && pending.damage.count == 2 &&
+		   test_damage_covers(&pending.damage, &d1.rects[0]) &&
+		   test_damage_covers(&pending.damage, &d2.rects[0]),
+		   "coalesced mark pending");
+
+	/* A new fb without an event, the pending event stays */
+	replaced = gm12u320_pending_mark(&pending, &fb_b, &d3, NULL,
+					 &old_fb, &old_event);
+	test_check(replaced && old_fb == &fb_a && !old_event, "new fb mark");
+	test_check(pending.fb == &fb_b && pending.event == &ev_b &&
+		   pending.damage.count == 1 &&
+		   !memcmp(&pending.damage.rects[0], &d3.rects[0],
+			   sizeof(d3.rects[0])),
+		   "new fb mark pending");
+
+	fb = gm12u320_pending_take(&pending, &damage, &event);
+	test_check(fb == &fb_b && event == &ev_b && damage.count == 1,
+		   "take");
+	test_check(!pending.fb && !pending.event, "take leaves nothing");
+
+	fb = gm12u320_pending_take(&pending, &damage, &event);
+	test_check(!fb && !event, "take when empty");
+
+	/* A dead worker hands back the pending event, and any new one */
+	gm12u320_pending_mark(&pending, &fb_a, &d1, &ev_a, &old_fb, &old_event);
+	event = gm12u320_pending_kill(&pending);
+	test_check(event == &ev_a && pending.dead && !pending.event, "kill");
+
+	replaced = gm12u320_pending_mark(&pending, &fb_a, &d2, &ev_c,
+					 &old_fb, &old_event);
+	test_check(!replaced && old_event == &ev_c && !pending.event,
+		   "mark when dead");
+}
+
+int main(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(test_formats); i++) {
+		test_convert(&test_formats[i]);
+		test_convert_color(&test_formats[i]);
+	}
+	test_layout();
+	test_blocks();
+	test_damage();
+	test_pending();
+
+	if (test_failed) {
+		printf("%d checks failed\n", test_failed);
+		return 1;
+	}
+
+	printf("all tests passed\n");
+	return 0;
+}
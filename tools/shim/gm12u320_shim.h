@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright 2019 Hans de Goede <hdegoede@redhat.com>
+ */
+
+#ifndef _GM12U320_SHIM_H_
+#define _GM12U320_SHIM_H_
+
+/*
+ * Userspace stand-ins for the few kernel helpers gm12u320_convert.[ch] and
+ * gm12u320_damage.[ch] use, so that they build as a plain library.
+ * The headers next to this one only include it.
+ */
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+
+/* types */
+#define BIT(n)				(1UL << (n))
+#define GENMASK(h, l)			(((~0UL) << (l)) & \
+					 (~0UL >> (8 * sizeof(long) - 1 - (h))))
+#define DIV_ROUND_UP(n, d)		(((n) + (d) - 1) / (d))
+#define ARRAY_SIZE(a)			(sizeof(a) / sizeof((a)[0]))
+
+/* minmax */
+#define min(a, b) ({				\
+	__typeof__(a) _a = (a);			\
+	__typeof__(b) _b = (b);			\
+	_a < _b ? _a : _b; })
+#define max(a, b) ({				\
+	__typeof__(a) _a = (a);			\
+	__typeof__(b) _b = (b);			\
+	_a > _b ? _a : _b; })
+#define clamp_val(val, lo, hi)		min(max(val, lo), hi)
+
+/* kref, the library never frees anything itself */
+struct kref {
+	int refcount;
+};
+
+static inline void kref_init(struct kref *kref)
+{
+	kref->refcount = 1;
+}
+
+static inline void kref_get(struct kref *kref)
+{
+	kref->refcount++;
+}
+
+static inline int kref_put(struct kref *kref,
+			   void (*release)(struct kref *kref))
+{
+	if (--kref->refcount)
+		return 0;
+
+	release(kref);
+	return 1;
+}
+
+/* unaligned */
+static inline u16 get_unaligned_le16(const void *p)
+{
+	const u8 *b = p;
+
+	return b[0] | b[1] << 8;
+}
+
+/* drm_rect */
+struct drm_rect {
+	int x1, y1, x2, y2;
+};
+
+static inline int drm_rect_width(const struct drm_rect *r)
+{
+	return r->x2 - r->x1;
+}
+
+static inline int drm_rect_height(const struct drm_rect *r)
+{
+	return r->y2 - r->y1;
+}
+
+static inline bool drm_rect_visible(const struct drm_rect *r)
+{
+	return drm_rect_width(r) > 0 && drm_rect_height(r) > 0;
+}
+
+#endif /* _GM12U320_SHIM_H_ */
@@ -0,0 +1,4 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* The uapi __u8 etc. too, for the tools which include uapi headers */
+#include_next <linux/types.h>
+#include "../gm12u320_shim.h"